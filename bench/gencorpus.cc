@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Generate a synthetic corpus of N versions of some C-like source files,
+ * for benchmarking difdef. The output directory gets subdirectories
+ * v0, v1, ... v(N-1), each holding the same set of file names; each
+ * version is derived from the previous one by random line edits, as
+ * if they were successive releases. The output depends only on the
+ * options (including --seed), never on the platform's rand().
+ */
+
+#include <cassert>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+typedef std::vector<std::string> Lines;
+
+static void do_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "ERROR: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(2);
+}
+
+static unsigned long long rng_state = 1;
+
+static unsigned long random_below(unsigned long n)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned long)((rng_state * 2685821657736338717ULL) >> 33) % n;
+}
+
+static bool random_chance(double p)
+{
+    return random_below(1000000) < p * 1000000;
+}
+
+struct Params {
+    int num_files;
+    size_t num_lines;
+    int num_versions;
+    double edit_density;
+    double unique_ratio;
+    int ifdef_depth;
+    size_t line_length;
+};
+
+/* Lines like these recur all over real code, and so are never unique. */
+static const char *const common_lines[] = {
+    "}", "{", "", "    }", "        break;", "    return 0;", "    return;",
+    "    } else {", "        continue;", "    /* fall through */", "    int i;",
+};
+static const size_t num_common_lines = sizeof common_lines / sizeof *common_lines;
+
+static unsigned long next_identifier = 0;
+
+static std::string unique_statement(const Params &p)
+{
+    char buffer[64];
+    sprintf(buffer, "    x%lu = f%lu(", next_identifier, random_below(1000));
+    ++next_identifier;
+    std::string result = buffer;
+    while (result.length() + 2 < p.line_length) {
+        sprintf(buffer, "a%lu, ", random_below(100));
+        result += buffer;
+    }
+    result += "0);";
+    return result;
+}
+
+static void generate_block(const Params &p, int depth, size_t n, Lines &out)
+{
+    size_t target = out.size() + n;
+    while (out.size() < target) {
+        if (depth < p.ifdef_depth && random_chance(0.02)) {
+            char buffer[32];
+            sprintf(buffer, "#if CONFIG_%lu", random_below(50));
+            out.push_back(buffer);
+            generate_block(p, depth+1, 1 + random_below(20), out);
+            if (random_chance(0.3)) {
+                out.push_back("#else");
+                generate_block(p, depth+1, 1 + random_below(10), out);
+            }
+            out.push_back("#endif");
+        } else if (random_chance(p.unique_ratio)) {
+            out.push_back(unique_statement(p));
+        } else {
+            out.push_back(common_lines[random_below(num_common_lines)]);
+        }
+    }
+}
+
+/* Derive the next version. Preprocessor directives are left alone,
+ * so that every version remains properly nested. */
+static Lines mutate(const Params &p, const Lines &in)
+{
+    Lines out;
+    for (size_t i=0; i < in.size(); ++i) {
+        const std::string &line = in[i];
+        if (line[0] == '#' || !random_chance(p.edit_density)) {
+            out.push_back(line);
+            continue;
+        }
+        switch (random_below(3)) {
+            case 0: break;  /* delete */
+            case 1: out.push_back(unique_statement(p)); break;  /* change */
+            case 2:  /* insert */
+                out.push_back(line);
+                generate_block(p, p.ifdef_depth, 1 + random_below(3), out);
+                break;
+        }
+    }
+    return out;
+}
+
+static void write_file(const std::string &name, const Lines &lines)
+{
+    FILE *out = fopen(name.c_str(), "w");
+    if (out == NULL) {
+        do_error("Output file '%s': Cannot create file", name.c_str());
+    }
+    for (size_t i=0; i < lines.size(); ++i) {
+        fputs(lines[i].c_str(), out);
+        putc('\n', out);
+    }
+    fclose(out);
+}
+
+static void do_help()
+{
+    puts("Usage: gencorpus [OPTION]... OUTDIR");
+    puts("Generate OUTDIR/v0 ... OUTDIR/vN-1, successive versions of some C-like files.");
+    puts("");
+    puts("  --files=NUM          Number of files in each version (default 1).");
+    puts("  --lines=NUM          Approximate lines per file (default 1000).");
+    puts("  --versions=NUM       Number of versions (default 2).");
+    puts("  --edit-density=P     Probability that a line is edited (default 0.05).");
+    puts("  --unique-ratio=P     Fraction of lines that are unique (default 0.7).");
+    puts("  --ifdef-depth=NUM    Maximum #if nesting (default 2).");
+    puts("  --line-length=NUM    Typical length of a unique line (default 40).");
+    puts("  --seed=NUM           Random seed (default 1).");
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    Params p;
+    p.num_files = 1;
+    p.num_lines = 1000;
+    p.num_versions = 2;
+    p.edit_density = 0.05;
+    p.unique_ratio = 0.7;
+    p.ifdef_depth = 2;
+    p.line_length = 40;
+
+    static const struct option longopts[] = {
+        { "edit-density", required_argument, NULL, 0 },
+        { "files", required_argument, NULL, 0 },
+        { "ifdef-depth", required_argument, NULL, 0 },
+        { "line-length", required_argument, NULL, 0 },
+        { "lines", required_argument, NULL, 0 },
+        { "seed", required_argument, NULL, 0 },
+        { "unique-ratio", required_argument, NULL, 0 },
+        { "versions", required_argument, NULL, 0 },
+        { "help", no_argument, NULL, 0 },
+        { NULL, 0, NULL, 0 },
+    };
+    int c;
+    int longopt_index;
+    while ((c = getopt_long(argc, argv, "", longopts, &longopt_index)) != -1) {
+        if (c != 0) {
+            do_error("Unrecognized option; try --help");
+        }
+        const char *name = longopts[longopt_index].name;
+        if (!strcmp(name, "help")) {
+            do_help();
+        }
+        assert(optarg != NULL);
+        char *end;
+        if (!strcmp(name, "edit-density")) {
+            p.edit_density = strtod(optarg, &end);
+        } else if (!strcmp(name, "unique-ratio")) {
+            p.unique_ratio = strtod(optarg, &end);
+        } else {
+            unsigned long value = strtoul(optarg, &end, 10);
+            if (!strcmp(name, "files")) p.num_files = value;
+            else if (!strcmp(name, "ifdef-depth")) p.ifdef_depth = value;
+            else if (!strcmp(name, "line-length")) p.line_length = value;
+            else if (!strcmp(name, "lines")) p.num_lines = value;
+            else if (!strcmp(name, "seed")) rng_state = value + 1;
+            else if (!strcmp(name, "versions")) p.num_versions = value;
+            else assert(false);
+        }
+        if (*end != '\0') {
+            do_error("invalid argument '%s' for --%s", optarg, name);
+        }
+    }
+    if (optind + 1 != argc) {
+        do_error("Expected a single output directory name; try --help");
+    }
+    if (p.num_versions < 1 || p.num_files < 1) {
+        do_error("There must be at least one version of at least one file");
+    }
+
+    const std::string root = argv[optind];
+    mkdir(root.c_str(), 0777);
+    for (int v=0; v < p.num_versions; ++v) {
+        char buffer[32];
+        sprintf(buffer, "/v%d", v);
+        if (mkdir((root + buffer).c_str(), 0777) != 0) {
+            do_error("Output directory '%s%s': Cannot create directory",
+                     root.c_str(), buffer);
+        }
+    }
+    for (int f=0; f < p.num_files; ++f) {
+        Lines lines;
+        generate_block(p, 0, p.num_lines, lines);
+        for (int v=0; v < p.num_versions; ++v) {
+            if (v != 0)
+                lines = mutate(p, lines);
+            char buffer[64];
+            sprintf(buffer, "/v%d/file%d.c", v, f);
+            write_file(root + buffer, lines);
+        }
+    }
+    return 0;
+}
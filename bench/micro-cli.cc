@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Microbenchmarks for the ifdef output: the C state machine, and the
+ * passes that rewrite a merge before it is printed. This file is
+ * ifdefs.cc itself, plus the benchmarks; see microbench.cc. */
+
+#include "../src/ifdefs.cc"
+
+#include <cstdarg>
+#include <cstdlib>
+
+#include "microbench.h"
+
+/* verify.o reports malformed input through this; our inputs are
+ * well-formed, so any call is a bug in the benchmark. */
+void do_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "ERROR: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(2);
+}
+
+
+/** CStateMachine::update ************************************************/
+
+static void run_state_machine(void *cookie)
+{
+    const std::vector<std::string> &lines = *(std::vector<std::string> *)cookie;
+    CStateMachine sm;
+    for (size_t i=0; i < lines.size(); ++i)
+        sm.update(lines[i]);
+}
+
+static void state_machine_benchmarks()
+{
+    static const char *const shapes[] = { "identifiers", "typical", "punctuation" };
+    for (size_t s=0; s < 3; ++s) {
+        std::vector<std::string> lines;
+        for (size_t i=0; i < 100000; ++i) {
+            if (s == 0) {
+                lines.push_back("    int identifier_without_any_special_characters = 42;");
+            } else if (s == 1) {
+                lines.push_back(bench_c_line(40));
+            } else {
+                /* Every character changes the state, or might. */
+                lines.push_back("'\"'/**/\"'\"//\"/*\"*/'\\''\\\\\"\\\"\"'/'*'/'");
+            }
+        }
+        run_benchmark("CStateMachine::update", shapes[s], NULL, run_state_machine, &lines);
+    }
+}
+
+
+/** The ifdef post-passes ************************************************/
+
+struct PassInput {
+    Difdef::Diff pristine;
+    Difdef::Diff work;
+    PassInput(const Difdef::Diff &d): pristine(d), work(d) { }
+};
+
+static void copy_pristine_diff(void *cookie)
+{
+    PassInput *in = (PassInput *)cookie;
+    in->work = in->pristine;
+}
+
+static void run_coalesce_endifs(void *cookie)
+{
+    coalesce_endifs(((PassInput *)cookie)->work);
+}
+
+static void run_split_ranges(void *cookie)
+{
+    split_if_elif_ranges_by_version(((PassInput *)cookie)->work);
+}
+
+static void run_collapse_blank_lines(void *cookie)
+{
+    collapse_blank_lines(((PassInput *)cookie)->work);
+}
+
+/* Some C-like code with #ifs and blank lines, in successive versions,
+ * each derived from the last by editing each line with probability
+ * "density". Directives are never edited, so every version nests. */
+static Difdef::Diff merge_versions(int num_versions, size_t num_lines,
+                                   double density, int blank_percent)
+{
+    std::vector<std::string> lines;
+    while (lines.size() < num_lines) {
+        if (bench_random(100) < 2) {
+            lines.push_back("#if CONFIG");
+            lines.push_back(bench_c_line(30));
+            lines.push_back(bench_random(2) ? "#else" : "#elif OTHER");
+            lines.push_back(bench_c_line(30));
+            lines.push_back("#endif");
+        } else if ((int)bench_random(100) < blank_percent) {
+            lines.push_back("");
+        } else {
+            lines.push_back(bench_c_line(30));
+        }
+    }
+    Difdef difdef(num_versions);
+    difdef.set_classifier(classify_line);
+    for (int v=0; v < num_versions; ++v) {
+        if (v != 0) {
+            std::vector<std::string> next;
+            for (size_t i=0; i < lines.size(); ++i) {
+                if (lines[i][0] == '#' || bench_random(1000) >= density * 1000)
+                    next.push_back(lines[i]);
+                else if (bench_random(2))
+                    next.push_back(bench_random(3) ? bench_c_line(30) : "");
+            }
+            lines.swap(next);
+        }
+        FILE *fp = tmpfile();
+        for (size_t i=0; i < lines.size(); ++i)
+            fprintf(fp, "%s\n", lines[i].c_str());
+        rewind(fp);
+        difdef.replace_file(v, fp);
+        fclose(fp);
+    }
+    return difdef.merge();
+}
+
+static void pass_benchmarks()
+{
+    static const struct {
+        const char *shape; int versions; double density; int blank_percent;
+    } shapes[] = {
+        { "identical", 2, 0.0, 10 },
+        { "typical", 4, 0.05, 10 },
+        { "churn", 8, 0.3, 30 },
+    };
+    for (size_t s=0; s < sizeof shapes / sizeof *shapes; ++s) {
+        PassInput in(merge_versions(shapes[s].versions, 5000,
+                                    shapes[s].density, shapes[s].blank_percent));
+        run_benchmark("coalesce_endifs", shapes[s].shape,
+                      copy_pristine_diff, run_coalesce_endifs, &in);
+        run_benchmark("split_if_elif_ranges", shapes[s].shape,
+                      copy_pristine_diff, run_split_ranges, &in);
+        run_benchmark("collapse_blank_lines", shapes[s].shape,
+                      copy_pristine_diff, run_collapse_blank_lines, &in);
+    }
+}
+
+
+void cli_benchmarks()
+{
+    bench_seed(2);
+    state_machine_benchmarks();
+    pass_benchmarks();
+}
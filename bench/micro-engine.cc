@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Microbenchmarks for the merge engine: reading lines, interning them,
+ * and the LCS and post-processing primitives. This file is the engine
+ * itself, plus the benchmarks; see microbench.cc. */
+
+#include "../libsrc/difdef_impl.cc"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "microbench.h"
+
+typedef std::vector<const std::string *> Strings;
+
+
+/** getline, fgetline_notrim, and splitting a buffer ********************/
+
+struct ReadInput {
+    FILE *fp;
+    std::string buffer;  // the same contents, for replace_buffer()
+};
+
+static void rewind_input(void *cookie)
+{
+    rewind(((ReadInput *)cookie)->fp);
+}
+
+static void run_getline(void *cookie)
+{
+    FILE *fp = ((ReadInput *)cookie)->fp;
+    std::string line;
+    while (getline(fp, line))
+        continue;
+}
+
+static void run_fgetline_notrim(void *cookie)
+{
+    FILE *fp = ((ReadInput *)cookie)->fp;
+    char *line;
+    while (fgetline_notrim(&line, fp) != NULL)
+        free(line);
+    free(line);
+}
+
+static void run_buffer_source(void *cookie)
+{
+    const std::string &buffer = ((ReadInput *)cookie)->buffer;
+    BufferSource source = { buffer.data(), buffer.data() + buffer.size() };
+    std::string line;
+    while (source.next(line))
+        continue;
+}
+
+static void getline_benchmarks()
+{
+    static const struct { const char *shape; size_t lines; size_t length; } shapes[] = {
+        { "short", 200000, 2 },
+        { "typical", 100000, 40 },
+        { "long-lines", 8, 1 << 20 },
+    };
+    for (size_t s=0; s < sizeof shapes / sizeof *shapes; ++s) {
+        ReadInput in;
+        in.fp = tmpfile();
+        for (size_t i=0; i < shapes[s].lines; ++i) {
+            in.buffer += bench_c_line(shapes[s].length);
+            in.buffer += '\n';
+        }
+        fputs(in.buffer.c_str(), in.fp);
+        run_benchmark("getline", shapes[s].shape, rewind_input, run_getline, &in);
+        run_benchmark("fgetline_notrim", shapes[s].shape, rewind_input, run_fgetline_notrim, &in);
+        run_benchmark("BufferSource::next", shapes[s].shape, NULL, run_buffer_source, &in);
+        fclose(in.fp);
+    }
+}
+
+
+/** Difdef_StringSet::add and lookup *************************************/
+
+struct StringSetInput {
+    std::vector<std::string> lines;
+    Difdef_StringSet *set;
+    Strings interned;
+};
+
+static void fresh_string_set(void *cookie)
+{
+    StringSetInput *in = (StringSetInput *)cookie;
+    delete in->set;
+    in->set = new Difdef_StringSet(2);
+}
+
+static void run_string_set_add(void *cookie)
+{
+    StringSetInput *in = (StringSetInput *)cookie;
+    for (size_t i=0; i < in->lines.size(); ++i)
+        in->set->add(i & 1, in->lines[i]);
+}
+
+static void run_string_set_lookup(void *cookie)
+{
+    StringSetInput *in = (StringSetInput *)cookie;
+    size_t total = 0;
+    for (size_t i=0; i < in->interned.size(); ++i)
+        total += in->set->lookup(in->interned[i]).id;
+    assert(total > 0);
+}
+
+static void string_set_benchmarks()
+{
+    static const char *const shapes[] = { "repeated", "distinct", "long-prefix" };
+    for (size_t s=0; s < 3; ++s) {
+        StringSetInput in;
+        in.set = NULL;
+        const std::string prefix = bench_c_line(200);
+        for (size_t i=0; i < 50000; ++i) {
+            char suffix[32];
+            sprintf(suffix, " %lu", (unsigned long)i);
+            if (s == 0 && i >= 100)
+                in.lines.push_back(in.lines[i % 100]);  /* 100 distinct lines */
+            else
+                in.lines.push_back((s == 2) ? prefix + suffix : bench_c_line(30) + suffix);
+        }
+        run_benchmark("StringSet::add", shapes[s], fresh_string_set, run_string_set_add, &in);
+        fresh_string_set(&in);
+        for (size_t i=0; i < in.lines.size(); ++i)
+            in.interned.push_back(in.set->add(0, in.lines[i]).text);
+        run_benchmark("StringSet::lookup", shapes[s], NULL, run_string_set_lookup, &in);
+        delete in.set;
+    }
+}
+
+
+/** patience_longest_increasing_sequence *********************************/
+
+static void run_patience(void *cookie)
+{
+    const std::vector<int> &v = *(std::vector<int> *)cookie;
+    std::vector<int> result = patience_longest_increasing_sequence(v);
+    assert(!result.empty());
+}
+
+static void patience_benchmarks()
+{
+    static const int n = 20000;
+    std::vector<int> sorted(n), shuffled(n), reversed(n);
+    for (int i=0; i < n; ++i) {
+        sorted[i] = shuffled[i] = i;
+        reversed[i] = n - i;
+    }
+    for (int i = n-1; i > 0; --i)
+        std::swap(shuffled[i], shuffled[bench_random(i+1)]);
+    run_benchmark("patience_lis", "sorted", NULL, run_patience, &sorted);
+    run_benchmark("patience_lis", "shuffled", NULL, run_patience, &shuffled);
+    run_benchmark("patience_lis", "reversed", NULL, run_patience, &reversed);
+}
+
+
+/** bit_parallel_lcs, approximate_lcs, and classical_lcs ****************/
+
+/* bit_parallel_lcs() is the exact LCS that merges normally use, and
+ * approximate_lcs() what replaces it under a cost budget. The memoized
+ * classical_lcs() now runs only on inputs too wide for the bit-parallel
+ * table; it's here as the reference the others are measured against. */
+
+struct LcsInput {
+    Strings a, b;
+};
+
+static void run_bit_parallel_lcs(void *cookie)
+{
+    LcsInput *in = (LcsInput *)cookie;
+    Strings result;
+    const bool fits = bit_parallel_lcs(in->a, in->b, result);
+    assert(fits && result.size() <= in->a.size());
+    (void)fits;
+}
+
+/* The smallest edit bound that add_vec_to_diff_classical() ever uses,
+ * so that every shape but "identical" restarts. */
+static const size_t APPROXIMATE_LCS_MAX_D = 16;
+
+static void run_approximate_lcs(void *cookie)
+{
+    LcsInput *in = (LcsInput *)cookie;
+    Strings result;
+    approximate_lcs(in->a, in->b, APPROXIMATE_LCS_MAX_D, result);
+    assert(result.size() <= in->a.size());
+}
+
+static void run_classical_lcs(void *cookie)
+{
+    LcsInput *in = (LcsInput *)cookie;
+    Memo memo;
+    LcsLines result = classical_lcs(in->a, in->b, in->a.size(), in->b.size(), memo);
+    assert(result.size() <= in->a.size());
+}
+
+static void lcs_benchmarks()
+{
+    static const char *const shapes[] = { "identical", "typical", "two-letter" };
+    static const size_t alphabet_sizes[] = { 1000, 50, 2 };
+    static const size_t lengths[] = { 400, 200, 120 };
+    std::vector<std::string> alphabet(1000);
+    for (size_t i=0; i < alphabet.size(); ++i)
+        alphabet[i] = bench_c_line(20);
+    for (size_t s=0; s < 3; ++s) {
+        LcsInput in;
+        for (size_t i=0; i < lengths[s]; ++i) {
+            in.a.push_back(&alphabet[bench_random(alphabet_sizes[s])]);
+            /* The typical input shares 70% of its lines. */
+            if (s == 0 || (s == 1 && bench_random(10) < 7))
+                in.b.push_back(in.a.back());
+            else
+                in.b.push_back(&alphabet[bench_random(alphabet_sizes[s])]);
+        }
+        run_benchmark("bit_parallel_lcs", shapes[s], NULL, run_bit_parallel_lcs, &in);
+        run_benchmark("approximate_lcs", shapes[s], NULL, run_approximate_lcs, &in);
+        run_benchmark("classical_lcs", shapes[s], NULL, run_classical_lcs, &in);
+    }
+}
+
+
+/** slide_diff_windows ***************************************************/
+
+struct SlideInput {
+    Difdef::Diff pristine;
+    Difdef::Diff work;
+    SlideInput(const Difdef::Diff &d): pristine(d), work(d) { }
+};
+
+static void copy_pristine_diff(void *cookie)
+{
+    SlideInput *in = (SlideInput *)cookie;
+    in->work = in->pristine;
+}
+
+static void run_slide_diff_windows(void *cookie)
+{
+    Difdef_impl::slide_diff_windows(((SlideInput *)cookie)->work);
+}
+
+/* The windows must come from a real merge, which upholds invariants
+ * that slide_diff_windows() asserts. Re-sliding a merge that has been
+ * slid already still walks every window. */
+static Difdef::Diff merge_two(const std::vector<std::string> &a,
+                              const std::vector<std::string> &b)
+{
+    Difdef difdef(2);
+    for (int v=0; v < 2; ++v) {
+        const std::vector<std::string> &lines = v ? b : a;
+        FILE *fp = tmpfile();
+        for (size_t i=0; i < lines.size(); ++i)
+            fprintf(fp, "%s\n", lines[i].c_str());
+        rewind(fp);
+        difdef.replace_file(v, fp);
+        fclose(fp);
+    }
+    return difdef.merge();
+}
+
+static void slide_benchmarks()
+{
+    static const char *const shapes[] = { "unchanged", "typical", "blank-runs" };
+    for (size_t s=0; s < 3; ++s) {
+        std::vector<std::string> a, b;
+        for (size_t i=0; a.size() < 10000; ++i) {
+            a.push_back(bench_c_line(30));
+            b.push_back(a.back());
+            if (s == 1 && bench_random(20) == 0) {
+                b.back() = bench_c_line(30);
+            } else if (s == 2) {
+                /* Inserted blocks ending in the same lines that precede
+                 * them, so that every window can slide. */
+                a.push_back("}");
+                a.push_back("");
+                b.push_back("}");
+                b.push_back("");
+                if (i % 2) {
+                    b.push_back("}");
+                    b.push_back("");
+                }
+            }
+        }
+        SlideInput in(merge_two(a, b));
+        run_benchmark("slide_diff_windows", shapes[s], copy_pristine_diff,
+                      run_slide_diff_windows, &in);
+    }
+}
+
+
+void engine_benchmarks()
+{
+    bench_seed(1);
+    getline_benchmarks();
+    string_set_benchmarks();
+    patience_benchmarks();
+    lcs_benchmarks();
+    slide_benchmarks();
+}
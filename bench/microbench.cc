@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* The driver for the kernel microbenchmarks. The kernels themselves are
+ * compiled from the same sources as difdef, by #including them into
+ * micro-engine.cc and micro-cli.cc, so that their static helpers are
+ * visible here without exporting anything from the real program.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <time.h>
+
+#include "microbench.h"
+
+static int warmup_runs = 3;
+static int timed_runs = 25;
+static const char *filter = NULL;  /* run only kernels containing this */
+static bool output_json = false;
+static bool first_result = true;
+
+static unsigned long long rng_state = 1;
+
+void bench_seed(unsigned long long seed)
+{
+    rng_state = seed + 1;
+}
+
+unsigned long bench_random(unsigned long n)
+{
+    /* xorshift64*, as in gencorpus.cc */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned long)((rng_state * 2685821657736338717ULL) >> 33) % n;
+}
+
+/* Something resembling a statement of C code, about "length" long. */
+std::string bench_c_line(size_t length)
+{
+    static const char *const pieces[] = {
+        "x", "foo", "(", ")", " = ", "++", " + ", "->next", "[i]", ";",
+        " /* note */", "\"str\"", "'c'", ", ", "0x1F", "bar_baz",
+    };
+    std::string result = "    ";
+    while (result.length() < length)
+        result += pieces[bench_random(sizeof pieces / sizeof *pieces)];
+    return result;
+}
+
+static double now_in_microseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    size_t k = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[k];
+}
+
+void run_benchmark(const char *kernel, const char *shape,
+                   BenchFunction setup, BenchFunction run, void *cookie)
+{
+    if (filter != NULL && strstr(kernel, filter) == NULL)
+        return;
+    for (int i=0; i < warmup_runs; ++i) {
+        if (setup != NULL) setup(cookie);
+        run(cookie);
+    }
+    std::vector<double> times;
+    for (int i=0; i < timed_runs; ++i) {
+        if (setup != NULL) setup(cookie);
+        double start = now_in_microseconds();
+        run(cookie);
+        times.push_back(now_in_microseconds() - start);
+    }
+    std::sort(times.begin(), times.end());
+    if (output_json) {
+        printf("%s  {\"kernel\": \"%s\", \"shape\": \"%s\", \"runs\": %d, "
+               "\"min_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+               "\"p99_us\": %.1f, \"max_us\": %.1f}",
+               first_result ? "" : ",\n", kernel, shape, timed_runs,
+               times.front(), percentile(times, 0.5), percentile(times, 0.9),
+               percentile(times, 0.99), times.back());
+    } else {
+        printf("%-32s %-12s %11.1f %11.1f %11.1f %11.1f %11.1f\n",
+               kernel, shape, times.front(), percentile(times, 0.5),
+               percentile(times, 0.9), percentile(times, 0.99), times.back());
+    }
+    first_result = false;
+    fflush(stdout);
+}
+
+static void do_help()
+{
+    puts("Usage: microbench [OPTION]... [KERNEL]");
+    puts("Time difdef's inner loops on fixed inputs; report percentiles in microseconds.");
+    puts("If KERNEL is given, run only the kernels whose names contain it.");
+    puts("");
+    puts("  --json         Output the results as JSON.");
+    puts("  --runs=NUM     Timed runs per benchmark (default 25).");
+    puts("  --warmup=NUM   Untimed runs before those (default 3).");
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longopts[] = {
+        { "json", no_argument, NULL, 0 },
+        { "runs", required_argument, NULL, 0 },
+        { "warmup", required_argument, NULL, 0 },
+        { "help", no_argument, NULL, 0 },
+        { NULL, 0, NULL, 0 },
+    };
+    int c;
+    int longopt_index;
+    while ((c = getopt_long(argc, argv, "", longopts, &longopt_index)) != -1) {
+        if (c != 0) {
+            fprintf(stderr, "ERROR: Unrecognized option; try --help\n");
+            exit(2);
+        }
+        const char *name = longopts[longopt_index].name;
+        if (!strcmp(name, "help")) {
+            do_help();
+        } else if (!strcmp(name, "json")) {
+            output_json = true;
+        } else if (!strcmp(name, "runs")) {
+            timed_runs = atoi(optarg);
+        } else if (!strcmp(name, "warmup")) {
+            warmup_runs = atoi(optarg);
+        }
+    }
+    if (timed_runs < 1) {
+        fprintf(stderr, "ERROR: --runs must be at least 1\n");
+        exit(2);
+    }
+    if (optind < argc) {
+        filter = argv[optind];
+    }
+
+    if (output_json) {
+        puts("[");
+    } else {
+        printf("%-32s %-12s %11s %11s %11s %11s %11s\n",
+               "kernel", "shape", "min_us", "p50_us", "p90_us", "p99_us", "max_us");
+    }
+    engine_benchmarks();
+    cli_benchmarks();
+    if (output_json) {
+        puts("\n]");
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef H_MICROBENCH
+ #define H_MICROBENCH
+
+#include <string>
+#include <vector>
+
+/* A benchmark is a "run" function, timed once per repetition, and an
+ * optional "setup" function called (untimed) before each run, both
+ * receiving the same cookie. Each kernel is measured on several input
+ * "shapes": the best case, a typical case, and an adversarial one. */
+typedef void (*BenchFunction)(void *cookie);
+
+void run_benchmark(const char *kernel, const char *shape,
+                   BenchFunction setup, BenchFunction run, void *cookie);
+
+/* A fixed-seed generator, so that every run sees the same inputs. */
+void bench_seed(unsigned long long seed);
+unsigned long bench_random(unsigned long n);
+std::string bench_c_line(size_t length);
+
+/* Defined in micro-engine.cc and micro-cli.cc respectively. */
+void engine_benchmarks();
+void cli_benchmarks();
+
+#endif /* H_MICROBENCH */
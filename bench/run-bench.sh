@@ -0,0 +1,97 @@
+#!/bin/bash
+# Time difdef on synthetic corpora and print the results as JSON.
+#
+# Usage: bench/run-bench.sh [DIFDEF [GENCORPUS]]
+#
+# The corpus shapes can be overridden from the environment:
+#   BENCH_LINES     lines per file                  (default "1000 10000")
+#   BENCH_VERSIONS  number of versions              (default "2 8")
+#   BENCH_DENSITY   edit density                    (default "0.05")
+#   BENCH_UNIQUE    unique-line ratio               (default "0.7")
+#   BENCH_DEPTH     #if nesting depth               (default "2")
+#   BENCH_LENGTH    typical line length             (default "40")
+#   BENCH_FILES     files per version, for -r mode  (default 20)
+#   BENCH_REPEAT    runs per measurement            (default 3)
+#
+# Each result records the minimum and median wall-clock time over
+# BENCH_REPEAT runs; compare results only between runs on the same machine.
+
+DIFDEF=${1:-./difdef}
+GENCORPUS=${2:-./gencorpus}
+LINES=${BENCH_LINES:-"1000 10000"}
+VERSIONS=${BENCH_VERSIONS:-"2 8"}
+DENSITY=${BENCH_DENSITY:-0.05}
+UNIQUE=${BENCH_UNIQUE:-0.7}
+DEPTH=${BENCH_DEPTH:-2}
+LENGTH=${BENCH_LENGTH:-40}
+FILES=${BENCH_FILES:-20}
+REPEAT=${BENCH_REPEAT:-3}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/difdef-bench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+now() {
+    date +%s.%N
+}
+
+# Run "$@" REPEAT times; print "min median" in seconds.
+time_command() {
+    local times=""
+    for ((r = 0; r < REPEAT; ++r)); do
+        rm -rf "$WORK/out"
+        local start=$(now)
+        "$@" >/dev/null 2>&1
+        local status=$?
+        local end=$(now)
+        if [ $status -gt 1 ]; then
+            echo "ERROR: '$*' exited with status $status" >&2
+            exit 1
+        fi
+        times="$times $(awk "BEGIN { print $end - $start }")"
+    done
+    echo $times | tr ' ' '\n' | sort -n | awk '
+        { t[NR] = $1 }
+        END { printf "%.4f %.4f", t[1], t[int((NR + 1) / 2)] }'
+}
+
+first=true
+echo "["
+for lines in $LINES; do
+    for versions in $VERSIONS; do
+        corpus="$WORK/corpus-$lines-$versions"
+        "$GENCORPUS" --lines=$lines --versions=$versions --files=$FILES \
+            --edit-density=$DENSITY --unique-ratio=$UNIQUE \
+            --ifdef-depth=$DEPTH --line-length=$LENGTH "$corpus" || exit 1
+        inputs=""
+        dirs=""
+        macros=""
+        for ((v = 0; v < versions; ++v)); do
+            inputs="$inputs $corpus/v$v/file0.c"
+            dirs="$dirs $corpus/v$v"
+            macros="$macros -DV$v"
+        done
+        for mode in raw unified ifdef recursive; do
+            case $mode in
+                raw) result=$(time_command "$DIFDEF" $inputs) ;;
+                unified) result=$(time_command "$DIFDEF" -u $corpus/v0/file0.c \
+                                  $corpus/v$((versions - 1))/file0.c) ;;
+                ifdef) result=$(time_command "$DIFDEF" $macros $inputs) ;;
+                recursive) result=$(time_command "$DIFDEF" -r $macros $dirs \
+                                    -o "$WORK/out") ;;
+            esac
+            [ -n "$result" ] || exit 1
+            set -- $result
+            $first || echo ","
+            first=false
+            printf '  {"mode": "%s", "lines": %d, "versions": %d, "files": %d, ' \
+                $mode $lines $versions $([ $mode = recursive ] && echo $FILES || echo 1)
+            printf '"edit_density": %s, "unique_ratio": %s, "ifdef_depth": %d, ' \
+                $DENSITY $UNIQUE $DEPTH
+            printf '"line_length": %d, "repeat": %d, "min_seconds": %s, "median_seconds": %s}' \
+                $LENGTH $REPEAT $1 $2
+        done
+        rm -rf "$corpus"
+    done
+done
+echo
+echo "]"
@@ -20,6 +20,7 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <algorithm>
 #include <cassert>
 #include <map>
 #include <string>
@@ -28,9 +29,13 @@
 #include "difdef.h"
 #include "difdef_impl.h"
 
-typedef std::map<std::pair<int,int>, std::vector<const std::string *> > Memo;
+typedef std::vector<const std::string *,
+                    Difdef::Allocator<const std::string *, Difdef::MEMORY_LCS> > LcsLines;
+typedef std::map<std::pair<int,int>, LcsLines, std::less<std::pair<int,int> >,
+                 Difdef::Allocator<std::pair<const std::pair<int,int>, LcsLines>,
+                                   Difdef::MEMORY_LCS> > Memo;
 
-static std::vector<const std::string *> classical_lcs(
+static LcsLines classical_lcs(
         const std::vector<const std::string *> &a,
         const std::vector<const std::string *> &b,
         int i,
@@ -41,7 +46,7 @@ static std::vector<const std::string *> classical_lcs(
     if (memo.find(key) != memo.end()) {
         return memo[key];
     } else if (i == 0 || j == 0) {
-        std::vector<const std::string *> result;
+        LcsLines result;
         memo[key] = result;
         return result;
     } else if (a[i-1] == b[j-1]) {
@@ -50,13 +55,13 @@ static std::vector<const std::string *> classical_lcs(
             --i;
             --j;
         }
-        std::vector<const std::string *> result = classical_lcs(a, b, i, j, memo);
+        LcsLines result = classical_lcs(a, b, i, j, memo);
         result.insert(result.end(), a.begin() + i, a.begin() + oldi);
         memo[key] = result;
         return result;
     } else {
-        std::vector<const std::string *> result1 = classical_lcs(a, b, i-1, j, memo);
-        std::vector<const std::string *> result2 = classical_lcs(a, b, i, j-1, memo);
+        LcsLines result1 = classical_lcs(a, b, i-1, j, memo);
+        LcsLines result2 = classical_lcs(a, b, i, j-1, memo);
         if (result1.size() > result2.size()) {
             memo[key] = result1;
             return result1;
@@ -68,9 +73,371 @@ static std::vector<const std::string *> classical_lcs(
 }
 
 
+/* For inputs whose shorter side fits in a few machine words, we can
+ * compute the whole LCS table bit-parallel (Allison-Dix, Hyyro). Each
+ * row of the table corresponds to a prefix of the longer sequence "y",
+ * and holds one bit per line of the shorter sequence "x"; the length of
+ * the LCS of that prefix of y and the first k lines of x is the number
+ * of zero bits among the row's low k bits. Each row costs O(k/64) time,
+ * instead of the O(k) cells (and map entries) of the memoized version.
+ */
+typedef unsigned long long Word;
+typedef std::vector<Word, Difdef::Allocator<Word, Difdef::MEMORY_LCS> > Words;
+static const size_t WORD_BITS = 64;
+static const size_t MAX_LCS_WORDS = 64;  // so x has at most 4096 lines
+/* The whole table would be this many words; but we keep only every
+ * K-th row, and recompute K rows at a time while walking back, for
+ * K = sqrt(rows). So this bounds the time, and the space is about
+ * 2*sqrt(rows) rows: some 260KB at most, where the whole table would be
+ * 32MB for each of the interstices running at once under -j. */
+static const size_t MAX_LCS_TABLE_WORDS = (1u << 22);
+
+static size_t count_zeros(const Word *row, size_t k)
+{
+    size_t ones = 0;
+    size_t w = 0;
+    for ( ; (w+1) * WORD_BITS <= k; ++w)
+        ones += __builtin_popcountll(row[w]);
+    if (w * WORD_BITS < k)
+        ones += __builtin_popcountll(row[w] & (((Word)1 << (k - w*WORD_BITS)) - 1));
+    return k - ones;
+}
+
+/* Compute the row after "prev", for line "line" of y. */
+static void next_lcs_row(const Word *prev, Word *row, size_t words, const std::string *line,
+                         const std::map<const std::string *, size_t> &symbol, const Words &match)
+{
+    std::map<const std::string *, size_t>::const_iterator it = symbol.find(line);
+    if (it == symbol.end()) {
+        std::copy(prev, prev + words, row);
+        return;
+    }
+    const Word *m = &match[it->second];
+    Word carry = 0;
+    for (size_t w=0; w < words; ++w) {
+        const Word v = prev[w];
+        const Word u = v & m[w];
+        const Word sum = v + u;
+        const Word total = sum + carry;
+        carry = (sum < v) | (total < sum);
+        row[w] = total | (v & ~m[w]);
+    }
+}
+
+/* Returns false if the input is too big for us. The result is exactly
+ * the sequence that classical_lcs(a, b, a.size(), b.size()) would
+ * return: we take a match whenever the last lines match, and otherwise
+ * drop the last line of "a" only if that gives a strictly longer LCS.
+ */
+static bool bit_parallel_lcs(const std::vector<const std::string *> &a,
+                             const std::vector<const std::string *> &b,
+                             std::vector<const std::string *> &lcs)
+{
+    const bool a_is_x = (a.size() <= b.size());
+    const std::vector<const std::string *> &x = (a_is_x ? a : b);
+    const std::vector<const std::string *> &y = (a_is_x ? b : a);
+    const size_t words = (x.size() + WORD_BITS - 1) / WORD_BITS;
+    if (words > MAX_LCS_WORDS || words * (y.size() + 1) > MAX_LCS_TABLE_WORDS)
+        return false;
+
+    lcs.clear();
+    if (words == 0)
+        return true;
+
+    /* match[symbol[s]*words ...] has a bit set for each line of x equal to s. */
+    std::map<const std::string *, size_t> symbol;
+    Words match;
+    for (size_t k=0; k < x.size(); ++k) {
+        std::map<const std::string *, size_t>::iterator it = symbol.find(x[k]);
+        if (it == symbol.end()) {
+            it = symbol.insert(std::make_pair(x[k], match.size())).first;
+            match.resize(match.size() + words);
+        }
+        match[it->second + k / WORD_BITS] |= ((Word)1 << (k % WORD_BITS));
+    }
+
+    /* Keep rows 0, K, 2K, ... of the table. */
+    size_t K = 1;
+    while (K * K < y.size() + 1)
+        ++K;
+    Words checkpoints((y.size() / K + 1) * words, ~(Word)0);
+    Words row(words, ~(Word)0);
+    Words next(words);
+    for (size_t r=1; r <= y.size(); ++r) {
+        next_lcs_row(&row[0], &next[0], words, y[r-1], symbol, match);
+        row.swap(next);
+        if (r % K == 0)
+            std::copy(row.begin(), row.end(), checkpoints.begin() + (r / K) * words);
+    }
+
+    /* Walk back from the bottom right corner. Each step looks at rows
+     * r-1 and r of the table, for r never increasing; "segment" holds
+     * rows base through base+K, recomputed from the checkpoint. */
+    Words segment((K + 1) * words);
+    size_t base = y.size() + 1;  // nothing loaded yet
+    size_t i = a.size();
+    size_t j = b.size();
+    while (i > 0 && j > 0) {
+        if (a[i-1] == b[j-1]) {
+            lcs.push_back(a[i-1]);
+            --i;
+            --j;
+        } else {
+            const size_t r = a_is_x ? j : i;
+            if (r-1 < base || r > base + K) {
+                base = ((r-1) / K) * K;
+                std::copy(checkpoints.begin() + (base / K) * words,
+                          checkpoints.begin() + (base / K + 1) * words, segment.begin());
+                for (size_t k=1; k <= K && base + k <= y.size(); ++k)
+                    next_lcs_row(&segment[(k-1) * words], &segment[k * words], words,
+                                 y[base + k - 1], symbol, match);
+            }
+            const Word *row_r = &segment[(r - base) * words];
+            const Word *row_r1 = &segment[(r - 1 - base) * words];
+            const size_t up = a_is_x ? count_zeros(row_r, i-1) : count_zeros(row_r1, j);
+            const size_t left = a_is_x ? count_zeros(row_r1, i) : count_zeros(row_r, j-1);
+            if (up > left) {
+                --i;
+            } else {
+                --j;
+            }
+        }
+    }
+    std::reverse(lcs.begin(), lcs.end());
+    return true;
+}
+
+
+
+/* Append to "lcs" a longest common subsequence of a[a0, a0+n) and
+ * b[b0, b0+m), by Myers' linear-space refinement: find the middle of an
+ * optimal path by searching forward from the start and backward from the
+ * end at once, and recurse on either side of it. The work is O((n+m)D)
+ * for D edits, and the space O(n+m).
+ */
+typedef std::vector<long, Difdef::Allocator<long, Difdef::MEMORY_LCS> > Furthest;
+
+static void myers_lcs(const std::vector<const std::string *> &a, long a0, long n,
+                      const std::vector<const std::string *> &b, long b0, long m,
+                      std::vector<const std::string *> &lcs)
+{
+    while (n > 0 && m > 0 && a[a0] == b[b0]) {
+        lcs.push_back(a[a0]);
+        ++a0;
+        ++b0;
+        --n;
+        --m;
+    }
+    long suffix = 0;
+    while (n > 0 && m > 0 && a[a0+n-1] == b[b0+m-1]) {
+        --n;
+        --m;
+        ++suffix;
+    }
+
+    /* Now both ends differ, so an optimal path has at least two edits,
+     * and its middle lies strictly inside the grid. */
+    long split_x = -1, split_y = -1;
+    if (n > 0 && m > 0) {
+        const long max_d = (n + m + 1) / 2;
+        const long offset = max_d;
+        /* forward[offset+k] is the furthest x reached on diagonal k from
+         * the start; backward[offset+k], how far back from the end on
+         * diagonal k (counted from the end). */
+        Furthest forward(2*max_d + 2, -1);
+        Furthest backward(2*max_d + 2, -1);
+        forward[offset+1] = 0;
+        backward[offset+1] = 0;
+        const long delta = n - m;
+        const bool front = (delta % 2 != 0);  // whether the forward search meets the backward one
+        long k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+        for (long d = 0; d < max_d && split_x < 0; ++d) {
+            for (long k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+                const long i = offset + k1;
+                long x1 = (k1 == -d || (k1 != d && forward[i-1] < forward[i+1]))
+                          ? forward[i+1] : forward[i-1] + 1;
+                long y1 = x1 - k1;
+                while (x1 < n && y1 < m && a[a0+x1] == b[b0+y1]) {
+                    ++x1;
+                    ++y1;
+                }
+                forward[i] = x1;
+                if (x1 > n) {
+                    k1end += 2;  // off the right edge
+                } else if (y1 > m) {
+                    k1start += 2;  // off the bottom edge
+                } else if (front) {
+                    const long j = offset + delta - k1;
+                    if (j >= 0 && j < 2*max_d && backward[j] != -1 && x1 >= n - backward[j]) {
+                        split_x = x1;
+                        split_y = y1;
+                        break;
+                    }
+                }
+            }
+            for (long k2 = -d + k2start; split_x < 0 && k2 <= d - k2end; k2 += 2) {
+                const long i = offset + k2;
+                long x2 = (k2 == -d || (k2 != d && backward[i-1] < backward[i+1]))
+                          ? backward[i+1] : backward[i-1] + 1;
+                long y2 = x2 - k2;
+                while (x2 < n && y2 < m && a[a0+n-x2-1] == b[b0+m-y2-1]) {
+                    ++x2;
+                    ++y2;
+                }
+                backward[i] = x2;
+                if (x2 > n) {
+                    k2end += 2;
+                } else if (y2 > m) {
+                    k2start += 2;
+                } else if (!front) {
+                    const long j = offset + delta - k2;
+                    if (j >= 0 && j < 2*max_d && forward[j] != -1 && forward[j] >= n - x2) {
+                        split_x = forward[j];
+                        split_y = offset + forward[j] - j;
+                    }
+                }
+            }
+        }
+    }
+    /* If the paths never met, nothing is in common. */
+    if (split_x >= 0) {
+        myers_lcs(a, a0, split_x, b, b0, split_y, lcs);
+        myers_lcs(a, a0 + split_x, n - split_x, b, b0 + split_y, m - split_y, lcs);
+    }
+
+    lcs.insert(lcs.end(), a.begin() + a0 + n, a.begin() + a0 + n + suffix);
+}
+
+
+/* When even the bit-parallel table would cost more than the caller's
+ * budget, fall back on Myers' O(ND) algorithm, but give up on finding
+ * the shortest edit script after "max_d" edits. At that point, take the
+ * path that got furthest toward the end, and start over from where it
+ * stopped. Either way, myers_lcs() then finds the matches along the way
+ * to that point, which it knows to be at most "max_d" edits away. The
+ * total work is about (na+nb)*max_d, and the space linear. The result
+ * is a common subsequence, but not necessarily the longest.
+ */
+static void approximate_lcs(const std::vector<const std::string *> &a,
+                            const std::vector<const std::string *> &b,
+                            size_t max_d,
+                            std::vector<const std::string *> &lcs)
+{
+    const long na = a.size();
+    const long nb = b.size();
+    const long D = max_d;
+    lcs.clear();
+    long x0 = 0;
+    long y0 = 0;
+    /* v[k + D] is the furthest x reached on diagonal k so far. Diagonals
+     * of one parity are read while the other's are written, so one row
+     * serves for every d. */
+    Furthest v(2*D + 1);
+
+    while (x0 < na || y0 < nb) {
+        const long n = na - x0;
+        const long m = nb - y0;
+        long end_x = -1, end_y = -1;
+        long d;
+        for (d = 0; d <= D && end_x < 0; ++d) {
+            for (long k = -d; k <= d; k += 2) {
+                long x;
+                if (d == 0) {
+                    x = 0;
+                } else if (k == -d || (k != d && v[k-1 + D] < v[k+1 + D])) {
+                    x = v[k+1 + D];  // down: skip a line of b
+                } else {
+                    x = v[k-1 + D] + 1;  // right: skip a line of a
+                }
+                long y = x - k;
+                while (x < n && y < m && a[x0 + x] == b[y0 + y]) {
+                    ++x;
+                    ++y;
+                }
+                v[k + D] = x;
+                if (x >= n && y >= m) {
+                    end_x = x;
+                    end_y = y;
+                    break;
+                }
+            }
+        }
+        if (end_x < 0) {
+            /* Out of budget; pick the furthest-reaching path that
+             * hasn't wandered off the edge of the grid. */
+            for (long k = -D; k <= D; k += 2) {
+                const long x = v[k + D];
+                const long y = x - k;
+                if (x > n || y < 0 || y > m) continue;
+                if (end_x < 0 || x + y > end_x + end_y) {
+                    end_x = x;
+                    end_y = y;
+                }
+            }
+            assert(end_x >= 0 && end_x + end_y > 0);
+        }
+
+        myers_lcs(a, x0, end_x, b, y0, end_y, lcs);
+        x0 += end_x;
+        y0 += end_y;
+    }
+}
+
+
+/* Roughly how many word operations the exact LCS of these sizes costs.
+ * The memoized recursion copies a vector into a map node for every cell
+ * it visits, so it's charged far more than one operation per cell. */
+static unsigned long long exact_lcs_cost(size_t na, size_t nb)
+{
+    const size_t x = std::min(na, nb);
+    const size_t y = std::max(na, nb);
+    const size_t words = (x + WORD_BITS - 1) / WORD_BITS;
+    if (words <= MAX_LCS_WORDS && words * (y + 1) <= MAX_LCS_TABLE_WORDS)
+        return (unsigned long long)words * (y + 1);
+    return (unsigned long long)na * nb * WORD_BITS;
+}
+
+
+/* Find the LCS of "a" and "b", the lines of one interstice between
+ * patience anchors, where "b" belongs to file "fileid". */
+void Difdef_impl::interstice_lcs(const std::vector<const std::string *> &a, int fileid,
+                                 const std::vector<const std::string *> &b,
+                                 std::vector<const std::string *> &lcs) const
+{
+    StatsTimer timer(STATS_FIELD(this, classical_ns));
+    if (this->stats != NULL) {
+        size_t bucket = 0;
+        for (size_t n = a.size() + b.size(); n > 1; n >>= 1)
+            ++bucket;
+        bucket = std::min(bucket, (size_t)Difdef::Stats::NUM_SIZE_BUCKETS - 1);
+        __sync_fetch_and_add(&this->stats->classical_calls, 1);
+        __sync_fetch_and_add(&this->stats->classical_sizes[bucket], 1);
+    }
+
+    std::vector<const std::string *> ta;
+    for (size_t i=0; i < a.size(); ++i) {
+        const std::string *line = a[i];
+        /* Lines in A which do not appear in B can't be part of the LCS. */
+        const Difdef_StringSet::Data &data = this->unique_lines.lookup(line);
+        if (this->unique_lines.count(data, fileid) > 0)
+            ta.push_back(line);
+    }
+
+    if (this->cost_budget != 0 && exact_lcs_cost(ta.size(), b.size()) > this->cost_budget) {
+        const unsigned long long max_d = this->cost_budget / (ta.size() + b.size());
+        approximate_lcs(ta, b, std::max(16ULL, std::min(4096ULL, max_d)), lcs);
+        __sync_fetch_and_add(&this->num_approximations, 1);
+    } else if (!bit_parallel_lcs(ta, b, lcs)) {
+        Memo memo;
+        const LcsLines exact = classical_lcs(ta, b, ta.size(), b.size(), memo);
+        lcs.assign(exact.begin(), exact.end());
+    }
+}
+
+
 void Difdef_impl::add_vec_to_diff_classical(Difdef::Diff &a,
                                             int fileid,
-                                            const std::vector<const std::string *> &b) const
+                                            const Lines &b) const
 {
     assert(this->NUM_FILES == a.dimension);
     assert(0 <= fileid && fileid < a.dimension && a.dimension <= Difdef::MAX_FILES);
@@ -80,19 +447,18 @@ void Difdef_impl::add_vec_to_diff_classical(Difdef::Diff &a,
     /* We are guaranteed that the input doesn't have a common prefix; our caller
      * should have taken care of that. The input may indeed have a common suffix. */
     if (b.empty()) return;
-    assert(a.lines.empty() || a.lines[0].text != b[0]);
+    assert(a.lines.empty() || a.lines[0].text != b[0].text);
 
-    std::vector<const std::string *> ta;
+    std::vector<const std::string *> texts(a.lines.size());
     for (size_t i=0; i < a.lines.size(); ++i) {
-        const std::string *line = a.lines[i].text;
-        /* Lines in A which do not appear in B can't be part of the LCS. */
-        const Difdef_StringSet::Data &data = this->unique_lines.lookup(line);
-        if (data.in[fileid] > 0)
-            ta.push_back(line);
+        texts[i] = a.lines[i].text;
     }
-
-    Memo memo;
-    std::vector<const std::string *> lcs = classical_lcs(ta, b, ta.size(), b.size(), memo);
+    std::vector<const std::string *> tb(b.size());
+    for (size_t i=0; i < b.size(); ++i) {
+        tb[i] = b[i].text;
+    }
+    std::vector<const std::string *> lcs;
+    this->interstice_lcs(texts, fileid, tb, lcs);
 
     Diff result(a.dimension, a.mask | bmask);
     size_t ak = 0;
@@ -101,24 +467,72 @@ void Difdef_impl::add_vec_to_diff_classical(Difdef::Diff &a,
         assert(ak < a.lines.size());
         assert(bk < b.size());
         while (a.lines[ak].text != lcs[lcx]) {
-            result.lines.push_back(Difdef::Diff::Line(a.lines[ak].text, a.lines[ak].mask));
+            result.lines.push_back(a.lines[ak]);
             ++ak;
         }
-        while (b[bk] != lcs[lcx]) {
-            result.lines.push_back(Difdef::Diff::Line(b[bk], bmask));
+        while (b[bk].text != lcs[lcx]) {
+            result.lines.push_back(b[bk]);
+            result.lines.back().mask = bmask;
             ++bk;
         }
         assert(a.lines[ak].text == lcs[lcx]);
-        assert(b[bk] == lcs[lcx]);
-        result.lines.push_back(Difdef::Diff::Line(lcs[lcx], a.lines[ak].mask | bmask));
+        assert(b[bk].text == lcs[lcx]);
+        result.lines.push_back(a.lines[ak]);
+        result.lines.back().mask |= bmask;
         ++ak;
         ++bk;
     }
     for ( ; ak < a.lines.size(); ++ak)
-        result.lines.push_back(Difdef::Diff::Line(a.lines[ak].text, a.lines[ak].mask));
-    for ( ; bk < b.size(); ++bk)
-        result.lines.push_back(Difdef::Diff::Line(b[bk], bmask));
+        result.lines.push_back(a.lines[ak]);
+    for ( ; bk < b.size(); ++bk) {
+        result.lines.push_back(b[bk]);
+        result.lines.back().mask = bmask;
+    }
 
     /* Now copy the new result into "a". */
     a = result;
 }
+
+
+/* The same, for the two-way merge: align a[a0,a1) with b[b0,b1) and
+ * append the result to "out". */
+void Difdef_impl::add_vec_to_script_classical(Difdef_ScriptBuilder &out,
+                                              const FileLines &a, size_t a0, size_t a1,
+                                              int fileid, const FileLines &b, size_t b0, size_t b1) const
+{
+    if (b0 == b1) {
+        for ( ; a0 < a1; ++a0)
+            out.push('-', a[a0].text, a[a0].priority);
+        return;
+    }
+    assert(a0 == a1 || a[a0].text != b[b0].text);
+
+    std::vector<const std::string *> ta(a1 - a0);
+    for (size_t i=0; i < ta.size(); ++i) {
+        ta[i] = a[a0 + i].text;
+    }
+    std::vector<const std::string *> tb(b1 - b0);
+    for (size_t i=0; i < tb.size(); ++i) {
+        tb[i] = b[b0 + i].text;
+    }
+    std::vector<const std::string *> lcs;
+    this->interstice_lcs(ta, fileid, tb, lcs);
+
+    size_t ak = a0;
+    size_t bk = b0;
+    for (size_t lcx = 0; lcx < lcs.size(); ++lcx) {
+        assert(ak < a1);
+        assert(bk < b1);
+        for ( ; a[ak].text != lcs[lcx]; ++ak)
+            out.push('-', a[ak].text, a[ak].priority);
+        for ( ; b[bk].text != lcs[lcx]; ++bk)
+            out.push('+', b[bk].text, b[bk].priority);
+        out.push('=', a[ak].text, a[ak].priority);
+        ++ak;
+        ++bk;
+    }
+    for ( ; ak < a1; ++ak)
+        out.push('-', a[ak].text, a[ak].priority);
+    for ( ; bk < b1; ++bk)
+        out.push('+', b[bk].text, b[bk].priority);
+}
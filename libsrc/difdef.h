@@ -21,7 +21,9 @@
  */
 #pragma once
 
+#include <cstddef>
 #include <istream>
+#include <new>
 #include <set>
 #include <string>
 #include <vector>
@@ -36,28 +38,144 @@ public:
     explicit Difdef(int num_files);  // Requires: 0 < num_files <= Difdef::MAX_FILES
     ~Difdef();
     void set_filter(std::string (*filter)(const std::string &));
+    void set_classifier(unsigned short (*classifier)(const std::string &));
+    void set_num_threads(int num_threads);  // default 1; see add_vec_to_diff()
+    void set_cost_budget(unsigned long long budget);  // default 0 (unlimited); see classical.cc
+    int num_approximations() const;  // in the last merge, due to the cost budget
+    void set_merge_by_similarity(bool);  // default false; see similarity_order()
+    struct Stats;
+    void set_stats(Stats *stats);  // default NULL; if set, add to *stats from now on
+    class LinePool;
+    void set_line_pool(LinePool *pool);  // default NULL; see LinePool
     void replace_file(int fileid, FILE *in);
+    // The same, reading "len" bytes from memory. The lines are interned as
+    // they're split, so the buffer may be freed as soon as this returns.
+    void replace_buffer(int fileid, const char *data, size_t len);
+    // Replace all NUM_FILES files at once; a NULL entry means an empty file.
+    // After set_num_threads(), the files are read in parallel, so loading
+    // takes about as long as the slowest file rather than all of them.
+    // A FILE that appears more than once is read in order, as if by
+    // successive replace_file() calls.
+    void replace_files(FILE *const ins[]);
+
+    // Memory accounting. The engine's big containers allocate through
+    // Difdef::Allocator, which counts their bytes by category. The counts
+    // are process-wide, over all Difdef objects and threads.
+    enum MemoryCategory {
+        MEMORY_INTERNER,  // the unique lines, and how often each file has them
+        MEMORY_LINES,  // each file's lines, as loaded by replace_file() etc.
+        MEMORY_DIFFS,  // merges, including the partial merges of the recursion
+        MEMORY_LCS,  // the classical LCS's tables and memo
+        NUM_MEMORY_CATEGORIES
+    };
+    struct MemoryUsage {
+        size_t current[NUM_MEMORY_CATEGORIES];
+        size_t peak[NUM_MEMORY_CATEGORIES];
+        size_t total_current;
+        size_t total_peak;  // of the sum, which may be less than the sum of the peaks
+    };
+    static MemoryUsage memory_usage();
+    // Default 0 (unlimited). An allocation that would take the total over
+    // the limit throws std::bad_alloc instead; the Difdef that threw may
+    // then only be destroyed.
+    static void set_memory_limit(size_t bytes);
+    static size_t memory_limit();
+    // Called by Allocator; and by the interner, for its strings' buffers.
+    static void note_allocation(MemoryCategory category, size_t bytes);  // may throw std::bad_alloc
+    static void note_deallocation(MemoryCategory category, size_t bytes);
+
+    template <class T, MemoryCategory Category>
+    class Allocator {
+    public:
+        typedef T value_type;
+        typedef T *pointer;
+        typedef const T *const_pointer;
+        typedef T &reference;
+        typedef const T &const_reference;
+        typedef size_t size_type;
+        typedef ptrdiff_t difference_type;
+        template <class U> struct rebind { typedef Allocator<U, Category> other; };
+
+        Allocator() { }
+        template <class U> Allocator(const Allocator<U, Category> &) { }
+        pointer address(reference x) const { return &x; }
+        const_pointer address(const_reference x) const { return &x; }
+        size_type max_size() const { return (size_t)-1 / sizeof (T); }
+        pointer allocate(size_type n, const void * = NULL) {
+            if (n > max_size()) throw std::bad_alloc();
+            note_allocation(Category, n * sizeof (T));
+            try {
+                return static_cast<pointer>(::operator new(n * sizeof (T)));
+            } catch (...) {
+                note_deallocation(Category, n * sizeof (T));
+                throw;
+            }
+        }
+        void deallocate(pointer p, size_type n) {
+            note_deallocation(Category, n * sizeof (T));
+            ::operator delete(p);
+        }
+        void construct(pointer p, const T &x) { new ((void *)p) T(x); }
+        void destroy(pointer p) { p->~T(); }
+        template <class U> bool operator==(const Allocator<U, Category> &) const { return true; }
+        template <class U> bool operator!=(const Allocator<U, Category> &) const { return false; }
+    };
+
+    // Interned lines can be shared between Difdef objects, e.g. the
+    // successive jobs of a server, so that a line common to them is
+    // copied and classified only once. Call set_line_pool() before loading
+    // any file; the pool must outlive the Difdef and its Diffs. Any number
+    // of Difdefs, on any threads, may share one pool.
+    class LinePool {
+    public:
+        explicit LinePool(size_t max_lines);
+        ~LinePool();
+        size_t size() const;  // in lines
+        // If the pool holds more than max_lines lines, forget them all.
+        // Requires: every Difdef given this pool has since been destroyed,
+        // or given another one.
+        void trim();
+    private:
+        struct Difdef_LinePool *impl;
+        friend class Difdef;
+        LinePool(const LinePool &);  // not copyable
+        LinePool &operator=(const LinePool &);
+    };
 
     struct Diff;
+    struct EditScript;
     Diff merge() const;  // merge all N files
     Diff merge(int fileid1, int fileid2) const;  // merge just two files
     Diff merge(const std::set<int> &fileids) const;  // merge a non-empty set of files
+    EditScript edit_script(int fileid1, int fileid2) const;  // same as merge(fileid1, fileid2)
+
+    // Merge all N files from these streams, "window_lines" lines of each at
+    // a time, handing each finished piece of the merge to "commit" and then
+    // forgetting it. Ignores any files loaded with replace_file(). Returns
+    // the number of windows that had to be committed whole, for lack of an
+    // anchor line; see the comments in the implementation.
+    size_t merge_streaming(FILE *const in[], size_t window_lines,
+                           void (*commit)(const Diff &, void *cookie), void *cookie);
 
     struct Diff {
         struct Line {
             const std::string *text;
             bool in_file(int fileid) const;
             mask_t mask;  // a bitmask
+            unsigned short flags;  // from the classifier; see set_classifier()
 
         private:
-            Line(): text(NULL), mask(0u) { }
-            Line(const std::string *, mask_t);
+            unsigned char priority;  // for slide_diff_windows()
+            Line(): text(NULL), mask(0u), flags(0), priority(0) { }
+            Line(const std::string *, mask_t, unsigned short, unsigned char);
             friend class Difdef;
             friend class Difdef_impl;
+            friend struct Difdef_StringSet;
             friend class std::vector<Line>;
         };
+        typedef std::vector<Line, Allocator<Line, MEMORY_DIFFS> > Lines;
         const int dimension;
-        std::vector<Line> lines;
+        Lines lines;
 
         Diff(const Diff &rhs);
         Diff &operator=(const Diff &rhs);
@@ -72,10 +190,42 @@ public:
         friend class Difdef_impl;
     };
 
+    // The merge of exactly two files, as runs of lines that appear in both
+    // files ('='), only in the first ('-'), or only in the second ('+').
+    struct EditScript {
+        struct Run {
+            char op;
+            size_t first;  // index of the run's first line in "lines"
+            size_t length;
+        };
+        std::vector<Run> runs;
+        std::vector<const std::string *> lines;  // in merged order
+    };
+
+    // Where the time went, for set_stats(). The engine only ever adds to
+    // these, so one Stats can total the work of many Difdef objects, and
+    // of many threads at once. The patience and classical times are CPU
+    // time, summed over the threads that merge interstices in parallel, so
+    // they may exceed merge_ns; the others are wall-clock times.
+    struct Stats {
+        enum { NUM_SIZE_BUCKETS = 24 };
+        unsigned long long read_ns;  // reading lines in replace_file() etc., less interning
+        unsigned long long intern_ns;
+        unsigned long long merge_ns;  // all of merge() or edit_script()
+        unsigned long long patience_ns;  // finding and matching unique lines
+        unsigned long long classical_ns;  // the fallback LCS, between anchors
+        unsigned long long slide_ns;
+        unsigned long unique_lines;
+        int max_depth;  // of the recursion between patience anchors
+        unsigned long classical_calls;
+        unsigned long classical_sizes[NUM_SIZE_BUCKETS];  // by floor(log2(lines on both sides))
+        Stats();  // all zeros
+    };
+
     // Construct a new Diff that's just these N files in order; merge common
     // versions if the whole version is identical, but don't merge lines from
-    // differing versions at all. Caller retains ownership of the strings.
-    static Diff simply_concatenate(const std::vector<std::vector<const std::string *> > &);
+    // differing versions at all. The lines' masks are ignored.
+    static Diff simply_concatenate(const std::vector<std::vector<Diff::Line> > &);
 
 private:
     class Difdef_impl *impl;
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <cerrno>
+#include <new>
+#include <set>
+
+#include "difdef.h"
+#include "difdef_c.h"
+
+struct difdef {
+    Difdef engine;
+    explicit difdef(int num_files): engine(num_files) { }
+};
+
+struct difdef_diff {
+    Difdef::Diff diff;
+    explicit difdef_diff(const Difdef::Diff &diff): diff(diff) { }
+};
+
+difdef_t *difdef_create(int num_files)
+{
+    if (num_files < 1 || num_files >= Difdef::MAX_FILES) {
+        errno = EINVAL;
+        return NULL;
+    }
+    try {
+        return new difdef(num_files);
+    } catch (const std::bad_alloc &) {
+        errno = ENOMEM;
+        return NULL;
+    }
+}
+
+void difdef_destroy(difdef_t *d)
+{
+    delete d;
+}
+
+int difdef_set_num_threads(difdef_t *d, int num_threads)
+{
+    if (num_threads < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    try {
+        d->engine.set_num_threads(num_threads);
+    } catch (const std::bad_alloc &) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+void difdef_set_cost_budget(difdef_t *d, unsigned long long budget)
+{
+    d->engine.set_cost_budget(budget);
+}
+
+void difdef_set_memory_limit(size_t bytes)
+{
+    Difdef::set_memory_limit(bytes);
+}
+
+int difdef_load_buffer(difdef_t *d, int fileid, const char *data, size_t len)
+{
+    if (fileid < 0 || fileid >= d->engine.NUM_FILES || (data == NULL && len != 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    try {
+        d->engine.replace_buffer(fileid, data, len);
+    } catch (const std::bad_alloc &) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+difdef_diff_t *difdef_merge(const difdef_t *d, unsigned int fileids_mask)
+{
+    const int n = d->engine.NUM_FILES;
+    if (fileids_mask == 0 || fileids_mask >= (1u << n)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    try {
+        std::set<int> fileids;
+        for (int i=0; i < n; ++i) {
+            if (fileids_mask & (1u << i))
+                fileids.insert(i);
+        }
+        return new difdef_diff(d->engine.merge(fileids));
+    } catch (const std::bad_alloc &) {
+        errno = ENOMEM;
+        return NULL;
+    }
+}
+
+int difdef_num_approximations(const difdef_t *d)
+{
+    return d->engine.num_approximations();
+}
+
+void difdef_diff_destroy(difdef_diff_t *diff)
+{
+    delete diff;
+}
+
+size_t difdef_diff_num_lines(const difdef_diff_t *diff)
+{
+    return diff->diff.lines.size();
+}
+
+const char *difdef_diff_line(const difdef_diff_t *diff, size_t i,
+                             size_t *length, unsigned int *mask)
+{
+    if (i >= diff->diff.lines.size()) {
+        errno = EINVAL;
+        return NULL;
+    }
+    const Difdef::Diff::Line &line = diff->diff.lines[i];
+    if (length != NULL)
+        *length = line.text->length();
+    if (mask != NULL)
+        *mask = line.mask;
+    return line.text->data();
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* A C interface to the merge engine, for embedding it in other programs
+ * (including non-C++ ones, via their C FFI) without the C++ ABI. Link
+ * with libdifdef.a or libdifdef.so, and with the C++ runtime.
+ *
+ * Functions that can fail return NULL or -1 and set errno: EINVAL for
+ * bad arguments, ENOMEM if out of memory (or over the limit set by
+ * difdef_set_memory_limit). No C++ exception ever escapes.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DIFDEF_C_API_VERSION 1
+
+typedef struct difdef difdef_t;
+typedef struct difdef_diff difdef_diff_t;
+
+/* 1 <= num_files <= 31. */
+difdef_t *difdef_create(int num_files);
+void difdef_destroy(difdef_t *d);
+
+int difdef_set_num_threads(difdef_t *d, int num_threads);
+void difdef_set_cost_budget(difdef_t *d, unsigned long long budget);
+void difdef_set_memory_limit(size_t bytes);  /* process-wide; 0 means unlimited */
+
+/* Replace file "fileid" with the "len" bytes at "data", which may be
+ * freed as soon as this returns; see Difdef::replace_buffer(). */
+int difdef_load_buffer(difdef_t *d, int fileid, const char *data, size_t len);
+
+/* Merge the files whose bits are set in "fileids_mask". The result
+ * refers to lines owned by "d", so free it before destroying "d" or
+ * loading another buffer into it. */
+difdef_diff_t *difdef_merge(const difdef_t *d, unsigned int fileids_mask);
+int difdef_num_approximations(const difdef_t *d);  /* in the last merge */
+void difdef_diff_destroy(difdef_diff_t *diff);
+
+size_t difdef_diff_num_lines(const difdef_diff_t *diff);
+/* The text of line "i" of the merge, without its newline and not
+ * NUL-terminated; its length goes in *length, and the mask of the
+ * files that contain it in *mask. Either pointer may be NULL. Returns
+ * NULL if there is no line "i". */
+const char *difdef_diff_line(const difdef_diff_t *diff, size_t i,
+                             size_t *length, unsigned int *mask);
+
+#ifdef __cplusplus
+}
+#endif
@@ -22,8 +22,13 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <deque>
+#include <new>
 #include <vector>
 
+#include <time.h>
+
 #include "difdef.h"
 #include "difdef_impl.h"
 #include "getline.h"
@@ -31,6 +36,92 @@
 typedef Difdef::mask_t mask_t;
 
 
+/** Statistics, for Difdef::set_stats() **********************************/
+
+
+static unsigned long long stats_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Add the time from construction until stop() (or destruction) to *total,
+ * atomically, since several threads may share one Stats. If total is NULL,
+ * don't even look at the clock. */
+class StatsTimer {
+    unsigned long long *total;
+    unsigned long long start;
+public:
+    explicit StatsTimer(unsigned long long *total):
+        total(total), start(total != NULL ? stats_clock() : 0) { }
+    ~StatsTimer() { stop(); }
+    void stop() {
+        if (total != NULL)
+            __sync_fetch_and_add(total, stats_clock() - start);
+        total = NULL;
+    }
+};
+
+#define STATS_FIELD(impl, field) ((impl)->stats != NULL ? &(impl)->stats->field : NULL)
+
+
+/** Memory accounting, for Difdef::Allocator *****************************/
+
+
+static size_t memory_current[Difdef::NUM_MEMORY_CATEGORIES];
+static size_t memory_peak[Difdef::NUM_MEMORY_CATEGORIES];
+static size_t memory_total;
+static size_t memory_total_peak;
+static size_t memory_limit_bytes;  // 0 means unlimited
+
+static void raise_peak(size_t *peak, size_t current)
+{
+    size_t old = *peak;
+    while (old < current && !__sync_bool_compare_and_swap(peak, old, current))
+        old = *peak;
+}
+
+void Difdef::note_allocation(MemoryCategory category, size_t bytes)
+{
+    const size_t total = __sync_add_and_fetch(&memory_total, bytes);
+    if (memory_limit_bytes != 0 && total > memory_limit_bytes) {
+        __sync_fetch_and_sub(&memory_total, bytes);
+        throw std::bad_alloc();
+    }
+    raise_peak(&memory_total_peak, total);
+    raise_peak(&memory_peak[category], __sync_add_and_fetch(&memory_current[category], bytes));
+}
+
+void Difdef::note_deallocation(MemoryCategory category, size_t bytes)
+{
+    __sync_fetch_and_sub(&memory_current[category], bytes);
+    __sync_fetch_and_sub(&memory_total, bytes);
+}
+
+Difdef::MemoryUsage Difdef::memory_usage()
+{
+    MemoryUsage usage;
+    for (int c=0; c < NUM_MEMORY_CATEGORIES; ++c) {
+        usage.current[c] = memory_current[c];
+        usage.peak[c] = memory_peak[c];
+    }
+    usage.total_current = memory_total;
+    usage.total_peak = memory_total_peak;
+    return usage;
+}
+
+void Difdef::set_memory_limit(size_t bytes)
+{
+    memory_limit_bytes = bytes;
+}
+
+size_t Difdef::memory_limit()
+{
+    return memory_limit_bytes;
+}
+
+
 /** Patience Diff algorithm implementation *******************************/
 
 
@@ -84,7 +175,9 @@ mask_t Difdef::Diff::all_files_mask() const
 }
 
 
-Difdef::Diff::Line::Line(const std::string *text, mask_t mask): text(text), mask(mask)
+Difdef::Diff::Line::Line(const std::string *text, mask_t mask,
+                         unsigned short flags, unsigned char priority):
+    text(text), mask(mask), flags(flags), priority(priority)
 {
     assert(text != NULL);
     assert(mask != 0);
@@ -116,11 +209,249 @@ void Difdef::set_filter(std::string (*filter)(const std::string &))
     this->impl->filter = filter;
 }
 
+void Difdef::set_classifier(unsigned short (*classifier)(const std::string &))
+{
+    this->impl->unique_lines.classifier = classifier;
+}
+
+void Difdef::set_num_threads(int num_threads)
+{
+    assert(num_threads >= 1);
+    delete this->impl->pool;
+    this->impl->pool = (num_threads > 1) ? new ThreadPool(num_threads) : NULL;
+}
+
+void Difdef::set_cost_budget(unsigned long long budget)
+{
+    this->impl->cost_budget = budget;
+}
+
+int Difdef::num_approximations() const
+{
+    return this->impl->num_approximations;
+}
+
+void Difdef::set_merge_by_similarity(bool enable)
+{
+    this->impl->merge_by_similarity = enable;
+}
+
+void Difdef::set_stats(Difdef::Stats *stats)
+{
+    this->impl->stats = stats;
+}
+
+Difdef::Stats::Stats():
+    read_ns(0), intern_ns(0), merge_ns(0), patience_ns(0), classical_ns(0),
+    slide_ns(0), unique_lines(0), max_depth(0), classical_calls(0)
+{
+    std::fill(classical_sizes, classical_sizes + NUM_SIZE_BUCKETS, 0);
+}
+
+void Difdef::set_line_pool(Difdef::LinePool *pool)
+{
+    Difdef_StringSet &set = this->impl->unique_lines;
+    assert(set.unique_lines.empty());
+    set.set_pool((pool != NULL) ? pool->impl : NULL);
+}
+
+/* FNV-1a. The top bits pick the shard and the bottom bits the bucket. */
+static unsigned long long line_hash(const std::string &text)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i=0; i < text.length(); ++i) {
+        h ^= (unsigned char)text[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+const std::string *Difdef_LinePool::intern(const std::string &text,
+                                           unsigned short (*classifier)(const std::string &),
+                                           unsigned short *flags, unsigned char *priority)
+{
+    const unsigned long long h = line_hash(text);
+    Shard &shard = this->shards[(this->num_shards == 1) ? 0 : (h >> (64 - SHARD_BITS))];
+    if (this->shared) pthread_mutex_lock(&shard.mutex);
+    Node *p = NULL;
+    try {
+        if (!shard.buckets.empty()) {
+            p = shard.buckets[h & (shard.buckets.size() - 1)];
+            while (p != NULL && (p->hash != h || p->text != text))
+                p = p->next;
+        }
+        if (p == NULL) {
+            p = this->insert(shard, h, text, classifier);
+            *flags = p->classified.flags;
+        } else {
+            *flags = classify(p, classifier);
+        }
+    } catch (...) {
+        if (this->shared) pthread_mutex_unlock(&shard.mutex);
+        throw;
+    }
+    *priority = p->priority;
+    if (this->shared) pthread_mutex_unlock(&shard.mutex);
+    return &p->text;
+}
+
+Difdef_LinePool::Node *Difdef_LinePool::insert(Shard &shard, unsigned long long h,
+                                               const std::string &text,
+                                               unsigned short (*classifier)(const std::string &))
+{
+    if (shard.size >= shard.buckets.size()) {
+        /* Double the table, keeping the load factor at most one. */
+        std::vector<Node *, Difdef::Allocator<Node *, Difdef::MEMORY_INTERNER> >
+            buckets(std::max<size_t>(16, 2 * shard.buckets.size()), (Node *)NULL);
+        for (size_t i=0; i < shard.buckets.size(); ++i) {
+            for (Node *p = shard.buckets[i]; p != NULL; ) {
+                Node *next = p->next;
+                Node *&head = buckets[p->hash & (buckets.size() - 1)];
+                p->next = head;
+                head = p;
+                p = next;
+            }
+        }
+        shard.buckets.swap(buckets);
+    }
+
+    const size_t bytes = sizeof (Node) + heap_bytes(text);
+    Difdef::note_allocation(Difdef::MEMORY_INTERNER, bytes);
+    Node *p;
+    try {
+        p = new Node(text);
+        p->classified.flags = (classifier != NULL) ? classifier(text) : 0;
+    } catch (...) {
+        Difdef::note_deallocation(Difdef::MEMORY_INTERNER, bytes);
+        throw;
+    }
+    p->hash = h;
+    p->priority = diff_ending_priority(text.c_str());
+    p->classified.by = classifier;
+    p->classified.next = NULL;
+    Node *&head = shard.buckets[h & (shard.buckets.size() - 1)];
+    p->next = head;
+    head = p;
+    shard.size += 1;
+    return p;
+}
+
+unsigned short Difdef_LinePool::classify(Node *node,
+                                         unsigned short (*classifier)(const std::string &))
+{
+    Classified *c = &node->classified;
+    while (c->by != classifier) {
+        if (c->next == NULL) {
+            /* Another Difdef sharing the pool classifies differently. */
+            Difdef::note_allocation(Difdef::MEMORY_INTERNER, sizeof (Classified));
+            Classified *added;
+            try {
+                added = new Classified;
+                added->flags = (classifier != NULL) ? classifier(node->text) : 0;
+            } catch (...) {
+                Difdef::note_deallocation(Difdef::MEMORY_INTERNER, sizeof (Classified));
+                throw;
+            }
+            added->by = classifier;
+            added->next = NULL;
+            c->next = added;
+        }
+        c = c->next;
+    }
+    return c->flags;
+}
+
+void Difdef_LinePool::free_node(Node *node)
+{
+    for (Classified *c = node->classified.next; c != NULL; ) {
+        Classified *next = c->next;
+        delete c;
+        Difdef::note_deallocation(Difdef::MEMORY_INTERNER, sizeof (Classified));
+        c = next;
+    }
+    Difdef::note_deallocation(Difdef::MEMORY_INTERNER, sizeof (Node) + heap_bytes(node->text));
+    delete node;
+}
+
+size_t Difdef_LinePool::size()
+{
+    size_t n = 0;
+    for (size_t k=0; k < this->num_shards; ++k) {
+        if (this->shared) pthread_mutex_lock(&this->shards[k].mutex);
+        n += this->shards[k].size;
+        if (this->shared) pthread_mutex_unlock(&this->shards[k].mutex);
+    }
+    return n;
+}
+
+/* Forget all the lines if there are more than max_lines. No Difdef may
+ * be using the pool, but size() may still be called from any thread, so
+ * take every shard's lock. */
+void Difdef_LinePool::trim()
+{
+    assert(this->attached == 0);
+    for (size_t k=0; k < this->num_shards; ++k)
+        pthread_mutex_lock(&this->shards[k].mutex);
+    size_t n = 0;
+    for (size_t k=0; k < this->num_shards; ++k)
+        n += this->shards[k].size;
+    if (n > this->max_lines)
+        this->clear();
+    for (size_t k=0; k < this->num_shards; ++k)
+        pthread_mutex_unlock(&this->shards[k].mutex);
+}
+
+void Difdef_LinePool::clear()
+{
+    for (size_t k=0; k < this->num_shards; ++k) {
+        Shard &shard = this->shards[k];
+        for (size_t i=0; i < shard.buckets.size(); ++i) {
+            for (Node *p = shard.buckets[i]; p != NULL; ) {
+                Node *next = p->next;
+                free_node(p);
+                p = next;
+            }
+        }
+        std::vector<Node *, Difdef::Allocator<Node *, Difdef::MEMORY_INTERNER> >().swap(shard.buckets);
+        shard.size = 0;
+    }
+}
+
+Difdef::LinePool::LinePool(size_t max_lines):
+    impl(new Difdef_LinePool(true, max_lines))
+{
+}
+
+Difdef::LinePool::~LinePool()
+{
+    delete this->impl;
+}
+
+size_t Difdef::LinePool::size() const
+{
+    return this->impl->size();
+}
+
+void Difdef::LinePool::trim()
+{
+    this->impl->trim();
+}
+
 void Difdef::replace_file(int fileid, FILE *in)
 {
     return this->impl->replace_file(fileid, in);
 }
 
+void Difdef::replace_buffer(int fileid, const char *data, size_t len)
+{
+    return this->impl->replace_buffer(fileid, data, len);
+}
+
+void Difdef::replace_files(FILE *const ins[])
+{
+    return this->impl->replace_files(ins);
+}
+
 Difdef::Diff Difdef::merge() const
 {
     assert(0 < this->NUM_FILES && this->NUM_FILES < Difdef::MAX_FILES);
@@ -137,6 +468,15 @@ Difdef::Diff Difdef::merge(int fileid1, int fileid2) const
     return this->impl->merge(m);
 }
 
+Difdef::EditScript Difdef::edit_script(int fileid1, int fileid2) const
+{
+    assert(0 <= fileid1 && fileid1 < this->NUM_FILES);
+    assert(0 <= fileid2 && fileid2 < this->NUM_FILES);
+    assert(fileid1 < fileid2);
+    mask_t m = ((mask_t)1 << fileid1) | ((mask_t)1 << fileid2);
+    return this->impl->merge_as<EditScript>(m);
+}
+
 Difdef::Diff Difdef::merge(const std::set<int> &fileids) const
 {
     assert(0 < this->NUM_FILES && this->NUM_FILES < Difdef::MAX_FILES);
@@ -149,22 +489,280 @@ Difdef::Diff Difdef::merge(const std::set<int> &fileids) const
 }
 
 
+/* To merge files that don't fit in memory, we merge a window of the next
+ * "window_lines" lines of each file. Then we look for an anchor: the last
+ * line of the merge that is shared by every file that has lines left in
+ * the window, and is unique within each of those windows. Everything up
+ * to and including the anchor is as good as final; commit it, discard the
+ * corresponding input lines, refill the windows, and repeat.
+ *
+ * If a window has no anchor at all, commit the whole window anyway; the
+ * merge will be poor around the window boundary, but memory use stays
+ * bounded. The caller gets the number of such windows, to warn the user.
+ */
+size_t Difdef::merge_streaming(FILE *const in[], size_t window_lines,
+                               void (*commit)(const Diff &, void *), void *cookie)
+{
+    assert(0 < this->NUM_FILES && this->NUM_FILES < Difdef::MAX_FILES);
+    assert(window_lines > 0);
+    const mask_t all_files = ((mask_t)1 << this->NUM_FILES) - (mask_t)1;
+    std::vector<std::deque<std::string> > pending(this->NUM_FILES);
+    std::vector<bool> at_eof(this->NUM_FILES, false);
+    size_t num_fallbacks = 0;
+    this->impl->num_approximations = 0;
+
+    while (true) {
+        bool all_at_eof = true;
+        mask_t live = 0;
+        for (int v=0; v < this->NUM_FILES; ++v) {
+            std::string line;
+            while (!at_eof[v] && pending[v].size() < window_lines) {
+                if (in[v] == NULL || !getline(in[v], line)) {
+                    at_eof[v] = true;
+                } else {
+                    if (this->impl->filter != NULL)
+                        line = this->impl->filter(line);
+                    pending[v].push_back(line);
+                }
+            }
+            all_at_eof = all_at_eof && at_eof[v];
+            if (!pending[v].empty())
+                live |= ((mask_t)1 << v);
+        }
+        if (live == 0)
+            break;
+
+        Difdef_impl window(this->NUM_FILES);
+        window.unique_lines.classifier = this->impl->unique_lines.classifier;
+        window.pool = this->impl->pool;
+        window.cost_budget = this->impl->cost_budget;
+        window.merge_by_similarity = this->impl->merge_by_similarity;
+        window.stats = this->impl->stats;
+        for (int v=0; v < this->NUM_FILES; ++v) {
+            for (size_t k=0; k < pending[v].size(); ++k)
+                window.lines[v].push_back(window.unique_lines.add(v, pending[v][k]));
+        }
+        Diff d = window.merge(all_files);
+        window.pool = NULL;  // it's not the window's to delete
+        this->impl->num_approximations += window.num_approximations;
+
+        size_t end = d.lines.size();
+        if (!all_at_eof) {
+            end = 0;
+            for (size_t k = d.lines.size(); k > 0 && end == 0; --k) {
+                const Diff::Line &line = d.lines[k-1];
+                if (line.mask != live)
+                    continue;
+                const Difdef_StringSet::Data &data = window.unique_lines.lookup(line.text);
+                bool is_unique = true;
+                for (int v=0; v < this->NUM_FILES; ++v) {
+                    if ((live & ((mask_t)1 << v)) &&
+                            window.unique_lines.count(data, v) != 1)
+                        is_unique = false;
+                }
+                if (is_unique)
+                    end = k;
+            }
+            if (end == 0) {
+                num_fallbacks += 1;
+                end = d.lines.size();
+            }
+        }
+
+        Diff chunk(this->NUM_FILES, d.mask);
+        chunk.lines.assign(d.lines.begin(), d.lines.begin() + end);
+        commit(chunk, cookie);
+        for (size_t k=0; k < end; ++k) {
+            for (int v=0; v < this->NUM_FILES; ++v) {
+                if (chunk.lines[k].in_file(v))
+                    pending[v].pop_front();
+            }
+        }
+    }
+    return num_fallbacks;
+}
+
+
 /** DifDef_impl private class functions **********************************/
 
 
+/* The sources of lines for load_lines(). Each next() is like getline():
+ * it returns the next line without its newline, if there is one. */
+namespace {
+struct FileSource {
+    FILE *in;
+    bool next(std::string &line) { return getline(in, line); }
+};
+
+/* Splitting a buffer ourselves means no stdio, and no allocation once
+ * "line" is as long as the longest line. Unlike getline(), we keep any
+ * NUL bytes in the line, rather than truncating it there. */
+struct BufferSource {
+    const char *p;
+    const char *end;
+    bool next(std::string &line) {
+        if (p == end) return false;
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        if (nl == NULL) nl = end;
+        line.assign(p, nl);
+        p = (nl == end) ? end : nl + 1;
+        return true;
+    }
+};
+}
+
+/* Empty file "fileid", so that it can be loaded again. */
+void Difdef_impl::clear_file(int fileid)
+{
+    if (!this->lines[fileid].empty()) {
+        this->lines[fileid].clear();
+        this->unique_lines.forget_file(fileid);
+    }
+}
+
 void Difdef_impl::replace_file(int fileid, FILE *in)
 {
     assert(0 <= fileid && fileid < this->NUM_FILES && this->NUM_FILES <= Difdef::MAX_FILES);
-    this->lines[fileid].clear();
-    if (in != NULL) {
-        std::string line;
-        while (getline(in, line)) {
-            if (this->filter != NULL)
-                line = this->filter(line);
-            const std::string *s = this->unique_lines.add(fileid, line);
-            this->lines[fileid].push_back(s);
+    this->clear_file(fileid);
+    if (in == NULL) return;
+    FileSource source = { in };
+    this->load_lines(fileid, source);
+}
+
+void Difdef_impl::replace_buffer(int fileid, const char *data, size_t len)
+{
+    assert(0 <= fileid && fileid < this->NUM_FILES && this->NUM_FILES <= Difdef::MAX_FILES);
+    assert(data != NULL || len == 0);
+    this->clear_file(fileid);
+    /* We can count the lines in advance, so never over-allocate. */
+    const size_t newlines = std::count(data, data + len, '\n');
+    this->lines[fileid].reserve(newlines + (len != 0 && data[len-1] != '\n'));
+    BufferSource source = { data, data + len };
+    this->load_lines(fileid, source);
+}
+
+template <class Source>
+void Difdef_impl::load_lines(int fileid, Source &source)
+{
+    const size_t old_unique_lines = this->unique_lines.unique_lines.size();
+    const unsigned long long start = (this->stats != NULL) ? stats_clock() : 0;
+    unsigned long long intern_ns = 0;
+    std::string line;
+    while (source.next(line)) {
+        if (this->filter != NULL)
+            line = this->filter(line);
+        if (this->stats == NULL) {
+            this->lines[fileid].push_back(this->unique_lines.add(fileid, line));
+        } else {
+            const unsigned long long t = stats_clock();
+            this->lines[fileid].push_back(this->unique_lines.add(fileid, line));
+            intern_ns += stats_clock() - t;
         }
     }
+    if (this->stats != NULL) {
+        __sync_fetch_and_add(&this->stats->read_ns, stats_clock() - start - intern_ns);
+        __sync_fetch_and_add(&this->stats->intern_ns, intern_ns);
+        __sync_fetch_and_add(&this->stats->unique_lines,
+                             this->unique_lines.unique_lines.size() - old_unique_lines);
+    }
+}
+
+/* replace_files() reads each file on a thread of its own into a table
+ * of the file's distinct lines, and then interns the tables' lines on
+ * this thread, each distinct line once per file. So the reading (which,
+ * from a network file system, is mostly waiting) overlaps, and what's
+ * left serial is proportional to the distinct lines, not all of them.
+ */
+namespace {
+struct ReadTask : public ThreadPool::Task {
+    struct Distinct {
+        size_t index;  // order of first appearance in the file
+        size_t occurrences;
+    };
+    typedef std::map<std::string, Distinct, std::less<std::string>,
+                     Difdef::Allocator<std::pair<const std::string, Distinct>,
+                                       Difdef::MEMORY_LINES> > Table;
+    FILE *in;
+    std::string (*filter)(const std::string &);
+    Table table;
+    std::vector<size_t, Difdef::Allocator<size_t, Difdef::MEMORY_LINES> > sequence;  // of indices
+    unsigned long long *read_ns;  // NULL unless we're keeping stats
+    bool out_of_memory;  // exceptions can't cross threads
+    ReadTask(): in(NULL), filter(NULL), read_ns(NULL), out_of_memory(false) { }
+    void run() {
+        const unsigned long long start = (read_ns != NULL) ? stats_clock() : 0;
+        try {
+            FileSource source = { in };
+            std::string line;
+            while (source.next(line)) {
+                if (filter != NULL)
+                    line = filter(line);
+                Table::iterator p = table.lower_bound(line);
+                if (p == table.end() || p->first != line) {
+                    Distinct d = { table.size(), 0 };
+                    p = table.insert(p, Table::value_type(line, d));
+                }
+                p->second.occurrences += 1;
+                sequence.push_back(p->second.index);
+            }
+        } catch (const std::bad_alloc &) {
+            out_of_memory = true;
+        }
+        if (read_ns != NULL)
+            __sync_fetch_and_add(read_ns, stats_clock() - start);
+    }
+};
+}
+
+void Difdef_impl::replace_files(FILE *const ins[])
+{
+    if (this->pool == NULL) {
+        for (int i=0; i < this->NUM_FILES; ++i)
+            this->replace_file(i, ins[i]);
+        return;
+    }
+    ThreadPool::Group group;
+    std::vector<ReadTask> tasks(this->NUM_FILES);
+    for (int i=0; i < this->NUM_FILES; ++i) {
+        this->clear_file(i);
+        tasks[i].in = ins[i];
+        tasks[i].filter = this->filter;
+        tasks[i].read_ns = (this->stats != NULL) ? &this->stats->read_ns : NULL;
+        if (ins[i] != NULL && std::find(ins, ins + i, ins[i]) == ins + i)
+            this->pool->submit(group, &tasks[i]);
+    }
+    this->pool->wait(group);
+    /* A FILE given more than once (e.g. stdin, as "difdef - -") can't be
+     * read by two threads at once; read the repeats in order, as
+     * replace_file() would have, after the first has been read. */
+    for (int i=0; i < this->NUM_FILES; ++i) {
+        if (ins[i] != NULL && std::find(ins, ins + i, ins[i]) != ins + i)
+            tasks[i].run();
+    }
+    for (int i=0; i < this->NUM_FILES; ++i) {
+        if (tasks[i].out_of_memory)
+            throw std::bad_alloc();
+    }
+
+    const size_t old_unique_lines = this->unique_lines.unique_lines.size();
+    const unsigned long long start = (this->stats != NULL) ? stats_clock() : 0;
+    for (int i=0; i < this->NUM_FILES; ++i) {
+        ReadTask &task = tasks[i];
+        FileLines distinct(task.table.size(), Diff::Line());
+        for (ReadTask::Table::const_iterator it = task.table.begin(); it != task.table.end(); ++it) {
+            distinct[it->second.index] = this->unique_lines.add(i, it->first, it->second.occurrences);
+        }
+        ReadTask::Table().swap(task.table);
+        this->lines[i].reserve(task.sequence.size());
+        for (size_t k=0; k < task.sequence.size(); ++k) {
+            this->lines[i].push_back(distinct[task.sequence[k]]);
+        }
+    }
+    if (this->stats != NULL) {
+        __sync_fetch_and_add(&this->stats->intern_ns, stats_clock() - start);
+        __sync_fetch_and_add(&this->stats->unique_lines,
+                             this->unique_lines.unique_lines.size() - old_unique_lines);
+    }
 }
 
 
@@ -173,7 +771,7 @@ void Difdef_impl::replace_file(int fileid, FILE *in)
  * If it's completely blank, it's above average priority.
  * Otherwise, it's low priority.
  */
-static int diff_ending_priority(const char *text)
+int diff_ending_priority(const char *text)
 {
     int i = 0;
     while (isspace(text[i])) ++i;
@@ -191,7 +789,7 @@ static inline bool contains(mask_t mortals, mask_t men)
 }
 
 
-static Difdef::Diff &slide_diff_windows(Difdef::Diff &d)
+Difdef::Diff &Difdef_impl::slide_diff_windows(Difdef::Diff &d)
 {
     /* As a special heuristic to produce nice merges for source code in
      * curly-brace languages, let's try to make differing ranges end with
@@ -225,9 +823,9 @@ static Difdef::Diff &slide_diff_windows(Difdef::Diff &d)
             int max_priority = 0;
             size_t max_priority_edge = 0;
             for (size_t j=0; j < window_down + window_up; ++j) {
-                const std::string &text = *d.lines[last_edge - window_down + j].text;
-                assert(text == *d.lines[i - window_down + j].text);
-                const int priority = diff_ending_priority(text.c_str());
+                const Difdef::Diff::Line &line = d.lines[last_edge - window_down + j];
+                assert(line.text == d.lines[i - window_down + j].text);
+                const int priority = line.priority;
                 if (priority > max_priority) {
                     max_priority = priority;
                     max_priority_edge = j+1;
@@ -254,27 +852,236 @@ static Difdef::Diff &slide_diff_windows(Difdef::Diff &d)
 }
 
 
-Difdef::Diff Difdef_impl::merge(unsigned int fmask) const
+/* The general N-way merge: fold each file in "fmask" into the merge in
+ * turn. */
+template <>
+Difdef::Diff Difdef_impl::merge_as<Difdef::Diff>(mask_t fmask) const
 {
     assert(this->lines.size() == (size_t)this->NUM_FILES);
     assert(0 < this->NUM_FILES && this->NUM_FILES <= Difdef::MAX_FILES);
     assert(fmask != 0);
     assert(fmask < ((mask_t)1 << this->NUM_FILES));
 
+    StatsTimer timer(STATS_FIELD(this, merge_ns));
+    this->num_approximations = 0;
     Diff d(this->NUM_FILES, 0);
-    for (size_t i=0; i < this->lines.size(); ++i) {
-        this->add_vec_to_diff(d, i, this->lines[i]);
+    if (this->merge_by_similarity && __builtin_popcount(fmask) > 2) {
+        const std::vector<int> order = this->similarity_order(fmask);
+        for (size_t k=0; k < order.size(); ++k) {
+            this->add_vec_to_diff(d, order[k], this->lines[order[k]]);
+        }
+    } else {
+        for (size_t i=0; i < this->lines.size(); ++i) {
+            if (fmask & ((mask_t)1 << i))
+                this->add_vec_to_diff(d, i, this->lines[i]);
+        }
     }
-    
+
+    StatsTimer slide_timer(STATS_FIELD(this, slide_ns));
     return slide_diff_windows(d);
 }
 
 
-void Difdef_impl::add_vec_to_diff(Difdef::Diff &a, int fileid, const std::vector<const std::string *> &b) const
+/* Folding a distant outlier into the merge early makes every later step
+ * more expensive. So estimate the similarity of each pair of files by
+ * MinHash over their sets of distinct lines, then start from the file
+ * most similar to all the others, and repeatedly fold in the remaining
+ * file most similar to any file already merged (Prim's algorithm on the
+ * similarity graph). Each file keeps its own bit in the masks.
+ */
+static unsigned long long mix64(unsigned long long h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+std::vector<int> Difdef_impl::similarity_order(mask_t fmask) const
+{
+    static const int K = 32;  // hash functions per signature
+    const int n = this->NUM_FILES;
+    std::vector<unsigned long long> minhash(n * K, ~0ULL);
+
+    /* Hash each distinct line once, by content, so that the order
+     * doesn't depend on where the strings happen to live in memory. */
+    Difdef_StringSet::unique_lines_type::const_iterator it;
+    for (it = this->unique_lines.unique_lines.begin();
+            it != this->unique_lines.unique_lines.end(); ++it) {
+        unsigned long long h = 14695981039346656037ULL;
+        for (size_t i=0; i < it->first->length(); ++i) {
+            h ^= (unsigned char)(*it->first)[i];
+            h *= 1099511628211ULL;
+        }
+        unsigned long long hk[K];
+        for (int k=0; k < K; ++k)
+            hk[k] = mix64(h + 0x9e3779b97f4a7c15ULL * (k+1));
+        for (int f=0; f < n; ++f) {
+            if (this->unique_lines.count(it->second, f) == 0) continue;
+            unsigned long long *sig = &minhash[f * K];
+            for (int k=0; k < K; ++k)
+                sig[k] = std::min(sig[k], hk[k]);
+        }
+    }
+
+    std::vector<int> similarity(n * n, 0);  // out of K
+    for (int f=0; f < n; ++f) {
+        for (int g=f+1; g < n; ++g) {
+            int same = 0;
+            for (int k=0; k < K; ++k)
+                same += (minhash[f*K + k] == minhash[g*K + k]);
+            similarity[f*n + g] = similarity[g*n + f] = same;
+        }
+    }
+
+    /* Files not in "fmask" take no part. */
+    std::vector<int> order;
+    std::vector<bool> done(n, false);
+    for (int f=0; f < n; ++f)
+        done[f] = !(fmask & ((mask_t)1 << f));
+    int best = -1, best_total = -1;
+    for (int f=0; f < n; ++f) {
+        if (done[f]) continue;
+        int total = 0;
+        for (int g=0; g < n; ++g) {
+            if (!done[g])
+                total += similarity[f*n + g];
+        }
+        if (total > best_total) {
+            best = f;
+            best_total = total;
+        }
+    }
+    /* closeness[g] is g's best similarity to any file merged so far. */
+    std::vector<int> closeness(n, -1);
+    while (best >= 0) {
+        order.push_back(best);
+        done[best] = true;
+        int next = -1;
+        for (int g=0; g < n; ++g) {
+            if (done[g]) continue;
+            closeness[g] = std::max(closeness[g], similarity[best*n + g]);
+            if (next < 0 || closeness[g] > closeness[next])
+                next = g;
+        }
+        best = next;
+    }
+    return order;
+}
+
+
+/* The two-way merge, as used by "difdef -u". This aligns the two files'
+ * own lines directly, emitting runs as it goes, rather than building a
+ * Diff and reconstructing the runs from its masks. The alignment is
+ * step for step the N-way merge's, so that the two can never disagree.
+ */
+template <>
+Difdef::EditScript Difdef_impl::merge_as<Difdef::EditScript>(mask_t fmask) const
+{
+    assert(fmask < ((mask_t)1 << this->NUM_FILES));
+    StatsTimer timer(STATS_FIELD(this, merge_ns));
+    int f[2];
+    int num_found = 0;
+    for (int i=0; i < this->NUM_FILES; ++i) {
+        if (fmask & ((mask_t)1 << i)) {
+            assert(num_found < 2);
+            f[num_found++] = i;
+        }
+    }
+    assert(num_found == 2);
+    const FileLines &a = this->lines[f[0]];
+    const FileLines &b = this->lines[f[1]];
+
+    this->num_approximations = 0;
+    Difdef_ScriptBuilder result;
+    result.script.lines.reserve(std::max(a.size(), b.size()));
+    result.priority.reserve(std::max(a.size(), b.size()));
+    this->add_vec_to_script(result, a, 0, a.size(), f[1], b, 0, b.size());
+    StatsTimer slide_timer(STATS_FIELD(this, slide_ns));
+    slide_script_windows(result);
+    return result.script;
+}
+
+
+/* slide_diff_windows(), for an EditScript. With only two files, the only
+ * range that can slide is a run of '-' or '+' between two runs of '=';
+ * sliding it moves its edges and leaves the text alone, since the lines
+ * it slides over match. A '=' run can shrink to nothing in the process,
+ * in which case the runs on either side of it don't slide, just as in
+ * slide_diff_windows(); we drop the empty runs at the end.
+ */
+void Difdef_impl::slide_script_windows(Difdef_ScriptBuilder &s)
+{
+    std::vector<Difdef::EditScript::Run> &runs = s.script.runs;
+    const std::vector<const std::string *> &text = s.script.lines;
+    for (size_t r=1; r+1 < runs.size(); ++r) {
+        Difdef::EditScript::Run &prev = runs[r-1];
+        Difdef::EditScript::Run &run = runs[r];
+        Difdef::EditScript::Run &next = runs[r+1];
+        if (run.op == '=' || prev.op != '=' || prev.length == 0 || next.op != '=')
+            continue;
+        const size_t first = run.first;
+        const size_t end = run.first + run.length;
+        size_t window_down = 0;
+        size_t window_up = 0;
+        while (window_down < std::min(prev.length, run.length) &&
+               text[first-window_down-1] == text[end-window_down-1])
+            ++window_down;
+        while (window_up < std::min(next.length, run.length) &&
+               text[end+window_up] == text[first+window_up])
+            ++window_up;
+        int max_priority = 0;
+        size_t max_priority_edge = 0;
+        for (size_t j=0; j < window_down + window_up; ++j) {
+            assert(text[first - window_down + j] == text[end - window_down + j]);
+            const int priority = s.priority[first - window_down + j];
+            if (priority > max_priority) {
+                max_priority = priority;
+                max_priority_edge = j+1;
+            }
+        }
+        /* Move the run so that it starts at first-window_down+max_priority_edge. */
+        const size_t new_first = first - window_down + max_priority_edge;
+        prev.length = new_first - prev.first;
+        run.first = new_first;
+        next.length = (next.first + next.length) - (new_first + run.length);
+        next.first = new_first + run.length;
+    }
+
+    size_t n = 0;
+    for (size_t r=0; r < runs.size(); ++r) {
+        if (runs[r].length == 0)
+            continue;
+        if (n != 0 && runs[n-1].op == runs[r].op)
+            runs[n-1].length += runs[r].length;
+        else
+            runs[n++] = runs[r];
+    }
+    runs.resize(n);
+}
+
+
+Difdef::Diff Difdef_impl::merge(unsigned int fmask) const
+{
+    return this->merge_as<Diff>(fmask);
+}
+
+
+template <class BLines>
+void Difdef_impl::add_vec_to_diff(Difdef::Diff &a, int fileid, const BLines &b, int depth) const
 {
     assert(this->NUM_FILES == a.dimension);
     assert(0 <= fileid && fileid < a.dimension && a.dimension <= Difdef::MAX_FILES);
 
+    if (this->stats != NULL) {
+        int old = this->stats->max_depth;
+        while (old < depth && !__sync_bool_compare_and_swap(&this->stats->max_depth, old, depth))
+            old = this->stats->max_depth;
+    }
+    StatsTimer patience_timer(STATS_FIELD(this, patience_ns));
+
     const mask_t bmask = (1u << fileid);
     assert((a.mask & bmask) == 0);
     Difdef::Diff result(a.dimension, a.mask | bmask);
@@ -282,9 +1089,9 @@ void Difdef_impl::add_vec_to_diff(Difdef::Diff &a, int fileid, const std::vector
 
     /* Record the common prefix. */
     size_t i = 0;
-    while (i < a.lines.size() && i < b.size() && a.lines[i].text == b[i]) {
-        const std::string *line = b[i];
-        result.lines.push_back(Difdef::Diff::Line(line, a.lines[i].mask | bmask));
+    while (i < a.lines.size() && i < b.size() && a.lines[i].text == b[i].text) {
+        result.lines.push_back(a.lines[i]);
+        result.lines.back().mask |= bmask;
         ++i;
     }
 
@@ -300,7 +1107,7 @@ void Difdef_impl::add_vec_to_diff(Difdef::Diff &a, int fileid, const std::vector
         const Difdef_StringSet::Data &d = this->unique_lines.lookup(line);
         /* We're looking for lines that appear uniquely in "b", and also in the
          * merged file that is "a". */
-        bool failed = (d.in[fileid] == 0);  /* appears nowhere in "b" */
+        bool failed = (this->unique_lines.count(d, fileid) == 0);  /* appears nowhere in "b" */
         if (failed) continue;
         /* We still need to make sure that "line" is unique in the merged "a".
          * The only way to do that is to search for it. */
@@ -312,7 +1119,7 @@ void Difdef_impl::add_vec_to_diff(Difdef::Diff &a, int fileid, const std::vector
         /* Okay, the line appears exactly once in this subrange of "a". */
         bool found = false;
         for (size_t k2 = i; !failed && k2 < jb; ++k2) {
-            if (b[k2] == line) {
+            if (b[k2].text == line) {
                 if (found) failed = true;
                 found = true;
             }
@@ -322,53 +1129,52 @@ void Difdef_impl::add_vec_to_diff(Difdef::Diff &a, int fileid, const std::vector
     }
 
     for (size_t k = i; k < jb; ++k) {
-        const std::string *line = b[k];
+        const std::string *line = b[k].text;
         if (std::find(ua.begin(), ua.end(), line) != ua.end())
            ub.push_back(line);
     }
 
     /* Run patience diff on these unique lines. */
     std::vector<const std::string *> lcs = patience_unique_lcs(ua, ub);
+    patience_timer.stop();
 
     if (lcs.empty()) {
         /* Base case: There are no unique shared lines between a and b.
          * In this case we want to fall back on the classical algorithm. */
         Diff ta(a.dimension, a.mask | bmask);
-        std::vector<const std::string *> tb(b.begin() + i, b.begin() + jb);
-        for (size_t k = i; k < ja; ++k) {
-            ta.lines.push_back(Difdef::Diff::Line(a.lines[k].text, a.lines[k].mask));
-        }
+        Lines tb(b.begin() + i, b.begin() + jb);
+        ta.lines.insert(ta.lines.end(), a.lines.begin() + i, a.lines.begin() + ja);
         this->add_vec_to_diff_classical(ta, fileid, tb);
         result.append(ta);
     } else {
         /* Recurse on the interstices. */
+        std::vector<Diff> ta(lcs.size() + 1, Diff(a.dimension, a.mask));
+        std::vector<Lines> tb(lcs.size() + 1);
+        std::vector<size_t> anchors(lcs.size());
         size_t ak = i;
         size_t bk = i;
-        Diff ta(a.dimension, a.mask);
-        std::vector<const std::string *> tb;
         for (size_t lcx = 0; lcx < lcs.size(); ++lcx) {
             assert(ak < ja);
             assert(bk < jb);
-            while (a.lines[ak].text != lcs[lcx]) { ta.lines.push_back(a.lines[ak]); ++ak; assert(ak < ja); }
-            while (b[bk] != lcs[lcx]) { tb.push_back(b[bk]); ++bk; assert(bk < jb); }
-            ta.mask = a.mask;
-            this->add_vec_to_diff(ta, fileid, tb);
-            result.append(ta);
-            ta.lines.clear();
-            tb.clear();
-            assert(ak < ja);
-            assert(bk < jb);
+            while (a.lines[ak].text != lcs[lcx]) { ta[lcx].lines.push_back(a.lines[ak]); ++ak; assert(ak < ja); }
+            while (b[bk].text != lcs[lcx]) { tb[lcx].push_back(b[bk]); ++bk; assert(bk < jb); }
             assert(a.lines[ak].text == lcs[lcx]);
-            assert(b[bk] == lcs[lcx]);
-            result.lines.push_back(Difdef::Diff::Line(lcs[lcx], a.lines[ak].mask | bmask));
+            assert(b[bk].text == lcs[lcx]);
+            anchors[lcx] = ak;
             ++ak;
             ++bk;
         }
-        while (ak < ja) { ta.lines.push_back(a.lines[ak]); ++ak; }
-        while (bk < jb) { tb.push_back(b[bk]); ++bk; }
-        ta.mask = a.mask;
-        this->add_vec_to_diff(ta, fileid, tb);
-        result.append(ta);
+        ta.back().lines.insert(ta.back().lines.end(), a.lines.begin() + ak, a.lines.begin() + ja);
+        tb.back().insert(tb.back().end(), b.begin() + bk, b.begin() + jb);
+
+        this->add_vecs_to_diffs(ta, fileid, tb, depth + 1);
+
+        for (size_t lcx = 0; lcx < lcs.size(); ++lcx) {
+            result.append(ta[lcx]);
+            result.lines.push_back(a.lines[anchors[lcx]]);
+            result.lines.back().mask |= bmask;
+        }
+        result.append(ta.back());
     }
 
     /* Now copy the new result into "a". */
@@ -376,19 +1182,212 @@ void Difdef_impl::add_vec_to_diff(Difdef::Diff &a, int fileid, const std::vector
 }
 
 
-static bool are_equal(const std::vector<const std::string *> &a,
-                      const std::vector<const std::string *> &b)
+/* The interstices between patience anchors are independent of each
+ * other. If we have a thread pool, hand the big ones to it; solve the
+ * small ones (and, while waiting, some of the big ones) ourselves.
+ */
+namespace {
+struct IntersticeTask : public ThreadPool::Task {
+    const Difdef_impl *impl;
+    Difdef::Diff *a;
+    int fileid;
+    const Difdef_impl::Lines *b;
+    int depth;
+    bool out_of_memory;  // exceptions can't cross threads; see add_vecs_to_diffs()
+    IntersticeTask(): impl(NULL), a(NULL), fileid(0), b(NULL), depth(0), out_of_memory(false) { }
+    void run() {
+        try {
+            impl->add_vec_to_diff(*a, fileid, *b, depth);
+        } catch (const std::bad_alloc &) {
+            out_of_memory = true;
+        }
+    }
+};
+}
+
+static const size_t PARALLEL_THRESHOLD = 1000;  // lines in both sides
+
+void Difdef_impl::add_vecs_to_diffs(std::vector<Diff> &as, int fileid,
+                                    const std::vector<Lines> &bs, int depth) const
+{
+    assert(as.size() == bs.size());
+    ThreadPool::Group group;
+    std::vector<IntersticeTask> tasks(as.size());
+    for (size_t k=0; k < as.size(); ++k) {
+        if (this->pool == NULL || as[k].lines.size() + bs[k].size() < PARALLEL_THRESHOLD)
+            continue;
+        tasks[k].impl = this;
+        tasks[k].a = &as[k];
+        tasks[k].fileid = fileid;
+        tasks[k].b = &bs[k];
+        tasks[k].depth = depth;
+        this->pool->submit(group, &tasks[k]);
+    }
+    /* The tasks point into our locals, so even if we run out of memory
+     * ourselves, we must wait for them before throwing. */
+    bool out_of_memory = false;
+    try {
+        for (size_t k=0; k < as.size(); ++k) {
+            if (tasks[k].impl == NULL)
+                this->add_vec_to_diff(as[k], fileid, bs[k], depth);
+        }
+    } catch (const std::bad_alloc &) {
+        out_of_memory = true;
+    }
+    if (this->pool != NULL)
+        this->pool->wait(group);
+    for (size_t k=0; k < as.size(); ++k)
+        out_of_memory = out_of_memory || tasks[k].out_of_memory;
+    if (out_of_memory)
+        throw std::bad_alloc();
+}
+
+
+/* add_vec_to_diff(), for the two-way merge: align a[a0,a1) with b[b0,b1)
+ * and append the result to "out". The anchors are the lines that appear
+ * exactly once in each range, as there; but since "a" is a single file
+ * here, we can simply count them.
+ */
+namespace {
+struct ScriptTask : public ThreadPool::Task {
+    const Difdef_impl *impl;
+    Difdef_ScriptBuilder out;
+    const Difdef_impl::FileLines *a;
+    size_t a0, a1;
+    int fileid;
+    const Difdef_impl::FileLines *b;
+    size_t b0, b1;
+    int depth;
+    bool in_pool;
+    bool out_of_memory;
+    ScriptTask(): impl(NULL), a(NULL), a0(0), a1(0), fileid(0), b(NULL), b0(0), b1(0),
+                  depth(0), in_pool(false), out_of_memory(false) { }
+    void run() {
+        try {
+            impl->add_vec_to_script(out, *a, a0, a1, fileid, *b, b0, b1, depth);
+        } catch (const std::bad_alloc &) {
+            out_of_memory = true;
+        }
+    }
+};
+}
+
+void Difdef_impl::add_vec_to_script(Difdef_ScriptBuilder &out,
+                                    const FileLines &a, size_t a0, size_t a1,
+                                    int fileid, const FileLines &b, size_t b0, size_t b1,
+                                    int depth) const
+{
+    if (this->stats != NULL) {
+        int old = this->stats->max_depth;
+        while (old < depth && !__sync_bool_compare_and_swap(&this->stats->max_depth, old, depth))
+            old = this->stats->max_depth;
+    }
+    StatsTimer patience_timer(STATS_FIELD(this, patience_ns));
+
+    /* Record the common prefix. */
+    while (a0 < a1 && b0 < b1 && a[a0].text == b[b0].text) {
+        out.push('=', a[a0].text, a[a0].priority);
+        ++a0;
+        ++b0;
+    }
+
+    /* How often each line of "a" appears in each range. */
+    typedef std::map<const std::string *, std::pair<int, int> > Tally;
+    Tally tally;
+    for (size_t k = a0; k < a1; ++k)
+        tally[a[k].text].first += 1;
+    for (size_t k = b0; k < b1; ++k) {
+        Tally::iterator p = tally.find(b[k].text);
+        if (p != tally.end())
+            p->second.second += 1;
+    }
+    std::vector<const std::string *> ua;
+    std::vector<const std::string *> ub;
+    for (size_t k = a0; k < a1; ++k) {
+        const std::pair<int, int> &n = tally[a[k].text];
+        if (n.first == 1 && n.second == 1)
+            ua.push_back(a[k].text);
+    }
+    for (size_t k = b0; k < b1; ++k) {
+        Tally::const_iterator p = tally.find(b[k].text);
+        if (p != tally.end() && p->second.first == 1 && p->second.second == 1)
+            ub.push_back(b[k].text);
+    }
+
+    std::vector<const std::string *> lcs = patience_unique_lcs(ua, ub);
+    patience_timer.stop();
+
+    if (lcs.empty()) {
+        this->add_vec_to_script_classical(out, a, a0, a1, fileid, b, b0, b1);
+        return;
+    }
+
+    /* Recurse on the interstices, as in add_vecs_to_diffs(). */
+    std::vector<ScriptTask> tasks(lcs.size() + 1);
+    size_t ak = a0;
+    size_t bk = b0;
+    for (size_t lcx = 0; lcx <= lcs.size(); ++lcx) {
+        ScriptTask &t = tasks[lcx];
+        t.impl = this;
+        t.a = &a;
+        t.a0 = ak;
+        t.fileid = fileid;
+        t.b = &b;
+        t.b0 = bk;
+        t.depth = depth + 1;
+        if (lcx < lcs.size()) {
+            while (a[ak].text != lcs[lcx]) { ++ak; assert(ak < a1); }
+            while (b[bk].text != lcs[lcx]) { ++bk; assert(bk < b1); }
+            t.a1 = ak++;
+            t.b1 = bk++;
+        } else {
+            t.a1 = a1;
+            t.b1 = b1;
+        }
+    }
+
+    ThreadPool::Group group;
+    for (size_t k=0; k < tasks.size(); ++k) {
+        ScriptTask &t = tasks[k];
+        if (this->pool == NULL || (t.a1 - t.a0) + (t.b1 - t.b0) < PARALLEL_THRESHOLD)
+            continue;
+        t.in_pool = true;
+        this->pool->submit(group, &t);
+    }
+    for (size_t k=0; k < tasks.size(); ++k) {
+        if (!tasks[k].in_pool)
+            tasks[k].run();  // catches bad_alloc, so we always get to wait
+    }
+    if (this->pool != NULL)
+        this->pool->wait(group);
+    bool out_of_memory = false;
+    for (size_t k=0; k < tasks.size(); ++k)
+        out_of_memory = out_of_memory || tasks[k].out_of_memory;
+    if (out_of_memory)
+        throw std::bad_alloc();
+
+    for (size_t lcx = 0; lcx < lcs.size(); ++lcx) {
+        out.append(tasks[lcx].out);
+        const Difdef::Diff::Line &anchor = a[tasks[lcx].a1];
+        out.push('=', anchor.text, anchor.priority);
+    }
+    out.append(tasks.back().out);
+}
+
+
+static bool are_equal(const std::vector<Difdef::Diff::Line> &a,
+                      const std::vector<Difdef::Diff::Line> &b)
 {
     const size_t n = a.size();
     if (b.size() != n) return false;
     for (size_t i=0; i < n; ++i) {
-        if (a[i] != b[i]) return false;
+        if (a[i].text != b[i].text) return false;
     }
     return true;
 }
 
 
-Difdef::Diff Difdef::simply_concatenate(const std::vector<std::vector<const std::string *> > &vec)
+Difdef::Diff Difdef::simply_concatenate(const std::vector<std::vector<Diff::Line> > &vec)
 {
     int num_files = vec.size();
     mask_t have_handled = 0;
@@ -403,7 +1402,8 @@ Difdef::Diff Difdef::simply_concatenate(const std::vector<std::vector<const std:
                 vmask |= wmask;
         }
         for (size_t i=0; i < vec[v].size(); ++i) {
-            result.lines.push_back(Difdef::Diff::Line(vec[v][i], vmask));
+            result.lines.push_back(vec[v][i]);
+            result.lines.back().mask = vmask;
         }
         have_handled |= vmask;
     }
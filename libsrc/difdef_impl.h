@@ -21,62 +21,246 @@
  */
 #pragma once
 
+#include <algorithm>
 #include <istream>
 #include <map>
 #include <string>
 #include <vector>
 
+#include <pthread.h>
+
 #include "difdef.h"
+#include "threadpool.h"
+
+int diff_ending_priority(const char *text);
+
+/* The strings that the Lines' "text" fields point to, one per distinct
+ * line, with what we know about each line that doesn't depend on the
+ * Difdef. Each Difdef_StringSet has a pool of its own, unless it's been
+ * given a shared one with Difdef::set_line_pool(). The lines live in a
+ * hash table split by hash into shards, each with its own lock; a shared
+ * pool locks just the shard it's looking in, since its Difdefs may be on
+ * any thread, and threads interning different lines rarely contend.
+ */
+struct Difdef_LinePool {
+    /* A line's flags under one classifier. Difdefs sharing a pool may
+     * classify differently, so a line keeps one of these for each
+     * classifier that has asked about it. */
+    struct Classified {
+        unsigned short (*by)(const std::string &);
+        unsigned short flags;
+        Classified *next;
+    };
+    struct Node {
+        std::string text;
+        unsigned long long hash;
+        unsigned char priority;  // from diff_ending_priority()
+        Classified classified;  // for the first classifier to ask
+        Node *next;  // in the same bucket
+        explicit Node(const std::string &text): text(text) { }
+    };
+    struct Shard {
+        std::vector<Node *, Difdef::Allocator<Node *, Difdef::MEMORY_INTERNER> > buckets;
+        size_t size;
+        pthread_mutex_t mutex;
+        Shard(): size(0) { pthread_mutex_init(&this->mutex, NULL); }
+        ~Shard() { pthread_mutex_destroy(&this->mutex); }
+    };
+    static const int SHARD_BITS = 6;  // in a shared pool
+    const bool shared;
+    const size_t max_lines;  // see Difdef::LinePool::trim()
+    const size_t num_shards;
+    Shard *shards;
+    int attached;  // Difdefs using the pool; see Difdef::set_line_pool()
+
+    Difdef_LinePool(bool shared, size_t max_lines):
+        shared(shared), max_lines(max_lines), num_shards(shared ? (1u << SHARD_BITS) : 1),
+        shards(new Shard[num_shards]), attached(0) { }
+    ~Difdef_LinePool() {
+        assert(this->attached == 0);
+        this->clear();
+        delete [] shards;
+    }
+
+    /* The nodes are counted as MEMORY_INTERNER by hand, including the
+     * buffers of the strings in them; short strings are stored inline. */
+    static size_t heap_bytes(const std::string &s) {
+        static const size_t inline_capacity = std::string().capacity();
+        return (s.length() > inline_capacity) ? s.length() + 1 : 0;
+    }
+
+    size_t size();
+    void clear();
+    void trim();
+    const std::string *intern(const std::string &text,
+                              unsigned short (*classifier)(const std::string &),
+                              unsigned short *flags, unsigned char *priority);
+
+private:
+    Node *insert(Shard &shard, unsigned long long hash, const std::string &text,
+                 unsigned short (*classifier)(const std::string &));
+    static unsigned short classify(Node *node, unsigned short (*classifier)(const std::string &));
+    static void free_node(Node *node);
+    Difdef_LinePool(const Difdef_LinePool &);  // not copyable
+    Difdef_LinePool &operator=(const Difdef_LinePool &);
+};
 
 struct Difdef_StringSet {
     /* effectively, friend class Difdef_impl; */
     const int NUM_FILES;
+    unsigned short (*classifier)(const std::string &);
+    Difdef_LinePool own_pool;
+    Difdef_LinePool *pool;  // &own_pool, unless Difdef::set_line_pool()
     struct Data {
-        std::vector<int> in;
+        size_t id;  // row of this line in the "counts" matrix
+        unsigned short flags;  // computed once, by the classifier
+        unsigned char priority;  // computed once, by diff_ending_priority()
     };
-    typedef std::map<std::string, Data> unique_lines_type;
+    /* Keyed by the pooled string, so lookup() needn't compare text. */
+    typedef std::map<const std::string *, Data, std::less<const std::string *>,
+                     Difdef::Allocator<std::pair<const std::string *const, Data>,
+                                       Difdef::MEMORY_INTERNER> > unique_lines_type;
     unique_lines_type unique_lines;
+    /* How many times each line appears in each file, saturating at
+     * COUNT_MANY: counts[id * NUM_FILES + fileid]. The merge only ever
+     * distinguishes zero, one, and more than one. */
+    static const unsigned char COUNT_MANY = 255;
+    std::vector<unsigned char, Difdef::Allocator<unsigned char, Difdef::MEMORY_INTERNER> > counts;
+
+    explicit Difdef_StringSet(int num_files):
+        NUM_FILES(num_files), classifier(NULL), own_pool(false, 0), pool(&own_pool) {}
+    ~Difdef_StringSet() { this->set_pool(NULL); }
 
-    explicit Difdef_StringSet(int num_files): NUM_FILES(num_files) {}
+    /* Use "shared" for the lines, or our own pool if it's NULL. */
+    void set_pool(Difdef_LinePool *shared) {
+        if (pool != &own_pool)
+            __sync_fetch_and_sub(&pool->attached, 1);
+        pool = (shared != NULL) ? shared : &own_pool;
+        if (pool != &own_pool)
+            __sync_fetch_and_add(&pool->attached, 1);
+    }
 
-    const std::string *add(int fileid, const std::string &text) {
-        unique_lines_type::iterator p = unique_lines.find(text);
-        if (p == unique_lines.end()) {
-            Data d;
-            d.in.resize(this->NUM_FILES);
-            d.in[fileid] = 1;
-            p = unique_lines.insert(p, unique_lines_type::value_type(text, d));
+    /* Add "occurrences" copies of "text" to file "fileid". */
+    Difdef::Diff::Line add(int fileid, const std::string &text, size_t occurrences = 1) {
+        Data d;
+        const std::string *key = pool->intern(text, this->classifier, &d.flags, &d.priority);
+        unique_lines_type::iterator p = unique_lines.lower_bound(key);
+        if (p == unique_lines.end() || p->first != key) {
+            d.id = unique_lines.size();
+            counts.resize(counts.size() + this->NUM_FILES);
+            counts[d.id * this->NUM_FILES + fileid] = std::min<size_t>(occurrences, COUNT_MANY);
+            p = unique_lines.insert(p, unique_lines_type::value_type(key, d));
         } else {
-            p->second.in[fileid] += 1;
+            unsigned char &n = counts[p->second.id * this->NUM_FILES + fileid];
+            n = std::min<size_t>(n + occurrences, COUNT_MANY);
         }
-        return &p->first;
+        return Difdef::Diff::Line(p->first, (Difdef::mask_t)1 << fileid,
+                                  p->second.flags, p->second.priority);
+    }
+
+    /* Forget how often each line appears in file "fileid". The lines
+     * themselves stay, with a count of zero. */
+    void forget_file(int fileid) {
+        for (size_t i = fileid; i < counts.size(); i += this->NUM_FILES)
+            counts[i] = 0;
     }
 
     const Data &lookup(const std::string *text) const {
-        unique_lines_type::const_iterator p = unique_lines.find(*text);
+        unique_lines_type::const_iterator p = unique_lines.find(text);
         assert(p != unique_lines.end());
         return p->second;
     }
+
+    int count(const Data &d, int fileid) const {
+        return counts[d.id * this->NUM_FILES + fileid];
+    }
+};
+
+/* An EditScript under construction by merge_as<EditScript>, together
+ * with each line's priority, for sliding the runs once it's complete. */
+struct Difdef_ScriptBuilder {
+    Difdef::EditScript script;
+    std::vector<unsigned char> priority;
+
+    void push(char op, const std::string *text, unsigned char line_priority) {
+        std::vector<Difdef::EditScript::Run> &runs = script.runs;
+        if (runs.empty() || runs.back().op != op) {
+            Difdef::EditScript::Run run;
+            run.op = op;
+            run.first = script.lines.size();
+            run.length = 0;
+            runs.push_back(run);
+        }
+        runs.back().length += 1;
+        script.lines.push_back(text);
+        priority.push_back(line_priority);
+    }
+
+    void append(const Difdef_ScriptBuilder &rhs) {
+        const std::vector<Difdef::EditScript::Run> &runs = rhs.script.runs;
+        for (size_t r=0; r < runs.size(); ++r) {
+            for (size_t i = runs[r].first; i < runs[r].first + runs[r].length; ++i)
+                this->push(runs[r].op, rhs.script.lines[i], rhs.priority[i]);
+        }
+    }
 };
 
 class Difdef_impl {
 public:
     const int NUM_FILES;  // set in constructor, read-only
     Difdef_StringSet unique_lines;
-    std::vector<std::vector<const std::string *> > lines;
+    typedef std::vector<Difdef::Diff::Line,
+                        Difdef::Allocator<Difdef::Diff::Line, Difdef::MEMORY_LINES> > FileLines;
+    std::vector<FileLines> lines;
     std::string (*filter)(const std::string &);
+    ThreadPool *pool;  // NULL if we're single-threaded
+    unsigned long long cost_budget;  // 0 means unlimited
+    mutable int num_approximations;  // in the last merge
+    bool merge_by_similarity;
+    Difdef::Stats *stats;  // NULL unless set_stats()
 
     typedef Difdef::Diff Diff;
     typedef Difdef::mask_t mask_t;
+    typedef Diff::Lines Lines;
 
     explicit Difdef_impl(int num_files):
         NUM_FILES(num_files), unique_lines(num_files),
-        lines(num_files), filter(NULL) { }
+        lines(num_files), filter(NULL), pool(NULL),
+        cost_budget(0), num_approximations(0), merge_by_similarity(false),
+        stats(NULL) { }
+    ~Difdef_impl() { delete pool; }
 
     void replace_file(int fileid, FILE *in);
+    void replace_buffer(int fileid, const char *data, size_t len);
+    void replace_files(FILE *const ins[]);
+    void clear_file(int fileid);
+    template <class Source> void load_lines(int fileid, Source &source);
 
     Diff merge(mask_t fileids_mask) const;  // merge a non-empty set of files
+    template <class Result> Result merge_as(mask_t fileids_mask) const;
+    std::vector<int> similarity_order(mask_t fileids_mask) const;
+
+    template <class BLines>  // Lines, or FileLines at the top level
+    void add_vec_to_diff(Diff &a, int fileid, const BLines &b, int depth = 0) const;
+    void add_vecs_to_diffs(std::vector<Diff> &as, int fileid,
+                           const std::vector<Lines> &bs, int depth) const;
+    void add_vec_to_diff_classical(Diff &a, int fileid, const Lines &b) const;
+    void interstice_lcs(const std::vector<const std::string *> &a, int fileid,
+                        const std::vector<const std::string *> &b,
+                        std::vector<const std::string *> &lcs) const;
+    static Diff &slide_diff_windows(Diff &d);
 
-    void add_vec_to_diff(Diff &a, int fileid, const std::vector<const std::string *> &b) const;
-    void add_vec_to_diff_classical(Diff &a, int fileid, const std::vector<const std::string *> &b) const;
+    /* The two-way merge works on ranges of the files' own lines. */
+    void add_vec_to_script(Difdef_ScriptBuilder &out, const FileLines &a, size_t a0, size_t a1,
+                           int fileid, const FileLines &b, size_t b0, size_t b1,
+                           int depth = 0) const;
+    void add_vec_to_script_classical(Difdef_ScriptBuilder &out,
+                                     const FileLines &a, size_t a0, size_t a1,
+                                     int fileid, const FileLines &b, size_t b0, size_t b1) const;
+    static void slide_script_windows(Difdef_ScriptBuilder &s);
 };
+
+/* merge_as<Diff> is the general N-way merge; merge_as<EditScript> is
+ * the two-way special case. There is no generic definition. */
+template <> Difdef::Diff Difdef_impl::merge_as<Difdef::Diff>(Difdef::mask_t) const;
+template <> Difdef::EditScript Difdef_impl::merge_as<Difdef::EditScript>(Difdef::mask_t) const;
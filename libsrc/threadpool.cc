@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <cassert>
+
+#include "threadpool.h"
+
+
+ThreadPool::ThreadPool(int num_threads):
+    NUM_THREADS(num_threads), shutting_down(false)
+{
+    assert(num_threads >= 1);
+    pthread_mutex_init(&this->mutex, NULL);
+    pthread_cond_init(&this->changed, NULL);
+    /* The caller of wait() is the remaining thread. */
+    for (int i=1; i < num_threads; ++i) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, worker_main, this) != 0)
+            break;  /* make do with fewer threads */
+        this->workers.push_back(t);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    pthread_mutex_lock(&this->mutex);
+    this->shutting_down = true;
+    pthread_cond_broadcast(&this->changed);
+    pthread_mutex_unlock(&this->mutex);
+    for (size_t i=0; i < this->workers.size(); ++i) {
+        pthread_join(this->workers[i], NULL);
+    }
+    assert(this->queue.empty());
+    pthread_cond_destroy(&this->changed);
+    pthread_mutex_destroy(&this->mutex);
+}
+
+void ThreadPool::submit(Group &group, Task *task)
+{
+    Job job;
+    job.task = task;
+    job.group = &group;
+    pthread_mutex_lock(&this->mutex);
+    group.pending += 1;
+    this->queue.push_back(job);
+    /* Wake the workers, and any waiters who might help. */
+    pthread_cond_broadcast(&this->changed);
+    pthread_mutex_unlock(&this->mutex);
+}
+
+/* Called with the mutex held; returns with it held. */
+void ThreadPool::run_locked(const Job &job)
+{
+    pthread_mutex_unlock(&this->mutex);
+    job.task->run();
+    pthread_mutex_lock(&this->mutex);
+    job.group->pending -= 1;
+    if (job.group->pending == 0)
+        pthread_cond_broadcast(&this->changed);
+}
+
+void ThreadPool::wait(Group &group)
+{
+    pthread_mutex_lock(&this->mutex);
+    while (group.pending != 0) {
+        if (!this->queue.empty()) {
+            /* Take the newest of our own jobs, so that waiting for the
+             * groups in turn runs them in turn; failing that, the newest
+             * job, which is most likely to be a subtask of ours. */
+            std::deque<Job>::iterator it = this->queue.end();
+            do {
+                --it;
+            } while (it != this->queue.begin() && it->group != &group);
+            if (it->group != &group)
+                it = this->queue.end() - 1;
+            Job job = *it;
+            this->queue.erase(it);
+            run_locked(job);
+        } else {
+            pthread_cond_wait(&this->changed, &this->mutex);
+        }
+    }
+    pthread_mutex_unlock(&this->mutex);
+}
+
+void *ThreadPool::worker_main(void *arg)
+{
+    ThreadPool *pool = static_cast<ThreadPool *>(arg);
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        if (!pool->queue.empty()) {
+            Job job = pool->queue.front();
+            pool->queue.pop_front();
+            pool->run_locked(job);
+        } else if (pool->shutting_down) {
+            break;
+        } else {
+            pthread_cond_wait(&pool->changed, &pool->mutex);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+/* A fixed set of worker threads, plus the threads that wait on them.
+ * A thread that waits for a group of tasks doesn't sleep while there
+ * is queued work; it runs tasks itself. So a task may safely submit
+ * subtasks and wait for them, to any depth, without deadlock.
+ */
+class ThreadPool {
+public:
+    struct Task {
+        virtual ~Task() { }
+        virtual void run() = 0;
+    };
+
+    /* The tasks submitted under one Group are waited for together. */
+    class Group {
+        int pending;
+        friend class ThreadPool;
+    public:
+        Group(): pending(0) { }
+    };
+
+    explicit ThreadPool(int num_threads);  // Requires: num_threads >= 1
+    ~ThreadPool();
+
+    const int NUM_THREADS;  // including the thread that calls wait()
+
+    void submit(Group &group, Task *task);  // does not take ownership
+    void wait(Group &group);
+
+private:
+    struct Job {
+        Task *task;
+        Group *group;
+    };
+    std::deque<Job> queue;
+    std::vector<pthread_t> workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;  // a job was queued or finished, or we're shutting down
+    bool shutting_down;
+
+    static void *worker_main(void *);
+    void run_locked(const Job &job);
+
+    ThreadPool(const ThreadPool &);  // not copyable
+    ThreadPool &operator=(const ThreadPool &);
+};
@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* "difdef --batch=FILE" runs all the jobs listed in FILE in one process,
+ * up to -j NUM of them at a time, so that a build that runs thousands of
+ * small merges pays for starting difdef only once. Each line of FILE is
+ * the arguments of one difdef command line, without the program name,
+ * separated by blanks; an argument may be enclosed in single quotes to
+ * include blanks. Blank lines, and lines starting with '#', are ignored.
+ * For example:
+ *     -DLINUX -DWIN32 linux/foo.c win32/foo.c -o merged/foo.c
+ *     -u 'old/bar baz.c' 'new/bar baz.c' -o bar.patch
+ * Whatever the jobs write to standard output appears there in the order
+ * of the jobs; their diagnostics go to standard error, each line prefixed
+ * by "FILE:LINE: ". A job that fails doesn't stop the others, but makes
+ * the batch as a whole exit with a failure status.
+ *
+ * All the jobs' options are parsed before any job starts, because
+ * getopt_long() isn't reentrant. The jobs then run in groups of a few per
+ * thread, sharing one Difdef::LinePool, which is trimmed between groups
+ * like the --server's. Each job's output is written out, and forgotten,
+ * as soon as it and all the jobs before it are done.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "diffn.h"
+#include "getline.h"
+#include "threadpool.h"
+
+/* See serve(). */
+static const size_t BATCH_POOL_LINES = 1000000;
+static const int JOBS_PER_THREAD = 4;  // in each group
+
+struct BatchJob : public ThreadPool::Task {
+    int line_number;
+    std::vector<std::string> args;
+    Options opts;
+    bool failed;
+    std::string parse_errors;
+    /* Only while the job's group is running; see open_streams(). */
+    char *output;
+    size_t output_length;
+    char *errors;
+    size_t errors_length;
+    FILE *out;
+    FILE *err;
+
+    explicit BatchJob(int line_number):
+        line_number(line_number), failed(false), output(NULL), output_length(0),
+        errors(NULL), errors_length(0), out(NULL), err(NULL) { }
+    ~BatchJob() {
+        this->close_streams();
+        free(output);
+        free(errors);
+    }
+
+    void parse();
+    void open_streams();
+    void close_streams();
+    void run();
+};
+
+/* Split "line" into blank-separated arguments, honoring single quotes. */
+static bool split_arguments(const std::string &line, std::vector<std::string> &args)
+{
+    size_t i = 0;
+    while (true) {
+        while (i < line.length() && isspace((unsigned char)line[i]))
+            ++i;
+        if (i == line.length())
+            return true;
+        std::string arg;
+        while (i < line.length() && !isspace((unsigned char)line[i])) {
+            if (line[i] == '\'') {
+                const size_t close = line.find('\'', i+1);
+                if (close == std::string::npos)
+                    return false;
+                arg.append(line, i+1, close-(i+1));
+                i = close+1;
+            } else {
+                arg += line[i++];
+            }
+        }
+        args.push_back(arg);
+    }
+}
+
+void BatchJob::parse()
+{
+    std::vector<char *> argv;
+    argv.push_back((char *)"difdef");
+    for (size_t i=0; i < this->args.size(); ++i) {
+        argv.push_back(&this->args[i][0]);
+    }
+    argv.push_back(NULL);
+
+    this->open_streams();
+    JobContext job;
+    job.err = this->err;
+    job.mode = "--batch";
+    current_job = &job;
+    try {
+        parse_options(argv.size() - 1, &argv[0], this->opts);
+    } catch (const JobError &e) {
+        fprintf(this->err, "ERROR: %s\n", e.what());
+        this->failed = true;
+    }
+    current_job = NULL;
+    this->close_streams();
+    this->parse_errors.assign(this->errors, this->errors_length);
+    free(this->output);
+    free(this->errors);
+    this->output = this->errors = NULL;
+}
+
+void BatchJob::open_streams()
+{
+    this->out = open_memstream(&this->output, &this->output_length);
+    this->err = open_memstream(&this->errors, &this->errors_length);
+    if (this->out == NULL || this->err == NULL) {
+        do_error("--batch: Out of memory");
+    }
+}
+
+void BatchJob::close_streams()
+{
+    if (this->out != NULL) fclose(this->out);
+    if (this->err != NULL) fclose(this->err);
+    this->out = this->err = NULL;
+}
+
+void BatchJob::run()
+{
+    if (this->failed) {
+        return;
+    }
+    JobContext job;
+    job.err = this->err;
+    job.mode = "--batch";
+    current_job = &job;
+    try {
+        run_job(this->opts, this->out);
+    } catch (const JobError &e) {
+        fprintf(this->err, "ERROR: %s\n", e.what());
+        this->failed = true;
+    } catch (const std::bad_alloc &) {
+        fprintf(this->err, "ERROR: Out of memory\n");
+        this->failed = true;
+    }
+    /* A job that fails partway may leave this set. */
+    run_stats = NULL;
+    current_job = NULL;
+}
+
+/* Copy "text" to "out", prefixing each line with "prefix". */
+static void print_prefixed(const char *text, size_t length, const std::string &prefix, FILE *out)
+{
+    bool at_line_start = true;
+    for (size_t i=0; i < length; ++i) {
+        if (at_line_start) {
+            fputs(prefix.c_str(), out);
+        }
+        putc(text[i], out);
+        at_line_start = (text[i] == '\n');
+    }
+    if (!at_line_start) {
+        putc('\n', out);
+    }
+}
+
+/* Write out a finished job's output and diagnostics, and free them. */
+static void finish_job(BatchJob &job, const char *filename)
+{
+    job.close_streams();
+    if (job.output != NULL) {
+        fwrite(job.output, 1, job.output_length, stdout);
+    }
+    char prefix[32];
+    snprintf(prefix, sizeof prefix, ":%d: ", job.line_number);
+    print_prefixed(job.parse_errors.data(), job.parse_errors.length(),
+                   filename + std::string(prefix), stderr);
+    if (job.errors != NULL) {
+        print_prefixed(job.errors, job.errors_length, filename + std::string(prefix), stderr);
+    }
+    fflush(stdout);
+    free(job.output);
+    free(job.errors);
+    job.output = job.errors = NULL;
+}
+
+int run_batch(const char *filename, int num_threads)
+{
+    FILE *in = fopen(filename, "r");
+    if (in == NULL) {
+        do_error("Batch file '%s': No such file or directory", filename);
+    }
+    std::vector<BatchJob *> jobs;
+    std::string line;
+    for (int line_number = 1; getline(in, line); ++line_number) {
+        std::vector<std::string> args;
+        const bool quotes_match = split_arguments(line, args);
+        if (quotes_match && (args.empty() || args[0][0] == '#')) {
+            continue;
+        }
+        BatchJob *job = new BatchJob(line_number);
+        jobs.push_back(job);
+        if (!quotes_match) {
+            job->parse_errors = "ERROR: unterminated quote\n";
+            job->failed = true;
+        } else {
+            job->args.swap(args);
+            job->parse();
+        }
+    }
+    fclose(in);
+
+    Difdef::LinePool pool(BATCH_POOL_LINES);
+    ThreadPool threads(num_threads);
+    const size_t group_size = (size_t)num_threads * JOBS_PER_THREAD;
+    int status = EXIT_SUCCESS;
+    for (size_t first = 0; first < jobs.size(); first += group_size) {
+        const size_t end = std::min(jobs.size(), first + group_size);
+        /* One Group per job, so that we can wait for them in order. */
+        std::vector<ThreadPool::Group> groups(end - first);
+        for (size_t i = first; i < end; ++i) {
+            if (!jobs[i]->failed) {
+                jobs[i]->open_streams();
+                jobs[i]->opts.line_pool = &pool;
+            }
+        }
+        for (size_t i = first; i < end; ++i) {
+            if (!jobs[i]->failed) {
+                threads.submit(groups[i - first], jobs[i]);
+            }
+        }
+        for (size_t i = first; i < end; ++i) {
+            threads.wait(groups[i - first]);
+            finish_job(*jobs[i], filename);
+            if (jobs[i]->failed) {
+                status = EXIT_FAILURE;
+            }
+            delete jobs[i];
+            jobs[i] = NULL;
+        }
+        pool.trim();
+    }
+    return status;
+}
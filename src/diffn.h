@@ -23,6 +23,9 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
+#include <map>
+#include <set>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -38,22 +41,212 @@ struct FileInfo {
     explicit FileInfo(): fp(NULL) { memset(&stat, 0, sizeof stat); }
 };
 
+/* Close each of "files" that is open, other than stdin. */
+inline void close_files(std::vector<FileInfo> &files)
+{
+    for (size_t i=0; i < files.size(); ++i) {
+        if (files[i].fp != NULL && files[i].fp != stdin)
+            fclose(files[i].fp);
+        files[i].fp = NULL;
+    }
+}
+
+/* These close what they hold when they go out of scope, so that a
+ * --server or --batch job that fails partway (do_error() throws) doesn't
+ * leak it. A file closed early must have its "fp" set to NULL. */
+class FilesCloser {
+    std::vector<FileInfo> &files;
+public:
+    explicit FilesCloser(std::vector<FileInfo> &files): files(files) { }
+    ~FilesCloser() { close_files(files); }
+};
+class FileCloser {
+    FILE *fp;
+    FILE *except;  /* e.g. the job's standard output, which isn't ours */
+public:
+    explicit FileCloser(FILE *fp, FILE *except = NULL): fp(fp), except(except) { }
+    ~FileCloser() { if (fp != NULL && fp != except) fclose(fp); }
+    FILE *release() { FILE *result = fp; fp = NULL; return result; }
+};
+
+/* The state of one input file, as recorded in the manifest that
+ * "difdef -r --update" keeps in its output directory. */
+struct InputStamp {
+    bool present;
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    unsigned long long hash;
+    bool hashed;
+};
+
+struct Manifest {
+    std::string root;
+    std::string header;
+    int num_files;
+    std::map<std::string, std::vector<InputStamp> > old_entries;
+    std::map<std::string, std::vector<InputStamp> > new_entries;
+    std::set<std::string> live_directories;
+};
+
+/* What "difdef -r" does with files that contain NUL bytes. */
+enum BinaryPolicy {
+    BINARY_SKIP,   /* produce no output for them, with a warning */
+    BINARY_ERROR,  /* stop with an error */
+    BINARY_TEXT    /* merge them as text anyway */
+};
+
+/* The totals reported by --stats, over every file merged. The engine
+ * fills in "engine" via Difdef::set_stats(); the rest are ours. */
+struct RunStats {
+    Difdef::Stats engine;
+    unsigned long long verify_ns;
+    unsigned long long postprocess_ns;
+    unsigned long long render_ns;
+    unsigned long lines_emitted;
+    RunStats(): verify_ns(0), postprocess_ns(0), render_ns(0), lines_emitted(0) { }
+};
+
+extern __thread RunStats *run_stats;  /* NULL unless --stats; per thread, for --batch */
+unsigned long long stats_clock();  /* in nanoseconds */
+void print_stats(const RunStats &stats, bool as_json, FILE *out);
+
+/* Chrome trace-event output for --trace; see trace.cc. */
+struct Tracer;
+extern Tracer *tracer;  /* NULL unless --trace */
+void trace_open(const char *filename);
+void trace_record(const char *phase, const std::string &file,
+                  unsigned long long start, unsigned long long end);
+void trace_close(size_t top_k, FILE *summary);
+
+/* Records the time from construction until end() (or destruction) as
+ * one span of "phase" for "file". Costs one test when not tracing. */
+class TraceSpan {
+    const char *phase;
+    const std::string &file;
+    unsigned long long start;
+public:
+    TraceSpan(const char *phase, const std::string &file):
+        phase(phase), file(file), start(tracer != NULL ? stats_clock() : 0) { }
+    ~TraceSpan() { end(); }
+    void end() {
+        if (tracer != NULL && phase != NULL)
+            trace_record(phase, file, start, stats_clock());
+        phase = NULL;
+    }
+};
+
+/* The settings for do_print_ifdefs_recursively(), which are the same
+ * at every level of the recursion. */
+struct RecursiveOptions {
+    std::vector<std::string> macro_names;
+    bool use_only_simple_ifs;
+    bool link_identical;
+    int num_threads;
+    unsigned long long cost_budget;
+    bool merge_by_similarity;
+    BinaryPolicy binary_policy;
+    Difdef::LinePool *line_pool;  /* NULL unless --server or --batch */
+    Manifest *manifest;  /* NULL unless --update */
+};
+
+/* Everything a command line asks for; or one job, in --server or
+ * --batch mode. */
+struct Options {
+    std::vector<std::string> macro_names;
+    const char *output_filename;  /* NULL means standard output */
+    bool print_using_ifdefs;
+    bool print_unified_diff;
+    bool print_recursively;
+    bool use_only_simple_ifs;
+    bool link_identical;
+    bool update_in_place;
+    bool normalize_whitespace;
+    size_t lines_of_context;
+    int num_threads;
+    size_t window_lines;
+    unsigned long long cost_budget;
+    bool merge_by_similarity;
+    bool want_stats;
+    bool stats_as_json;
+    const char *trace_filename;
+    BinaryPolicy binary_policy;
+    size_t max_memory;  /* 0 means unlimited */
+    bool serve;
+    const char *batch_filename;  /* NULL unless --batch */
+    std::vector<std::string> file_names;
+    const std::vector<std::string> *buffers;  /* a job's inline inputs, or NULL */
+    Difdef::LinePool *line_pool;  /* NULL unless --server or --batch */
+    Options():
+        output_filename(NULL), print_using_ifdefs(false), print_unified_diff(false),
+        print_recursively(false), use_only_simple_ifs(true), link_identical(false),
+        update_in_place(false), normalize_whitespace(false), lines_of_context(0),
+        num_threads(1), window_lines(0), cost_budget(0), merge_by_similarity(false),
+        want_stats(false), stats_as_json(false), trace_filename(NULL),
+        binary_policy(BINARY_SKIP), max_memory(0), serve(false), batch_filename(NULL),
+        buffers(NULL), line_pool(NULL) { }
+};
+
+void parse_options(int argc, char **argv, Options &opts);
+void run_job(const Options &opts, FILE *standard_output);
+
+/* While a --server or --batch job runs, do_error() throws a JobError
+ * (after which the job is abandoned) instead of exiting, and warnings go
+ * to the job's own stream; see server.cc and batch.cc. */
+struct JobContext {
+    FILE *err;
+    const char *mode;  /* "--server" or "--batch", for messages */
+};
+struct JobError : public std::runtime_error {
+    explicit JobError(const std::string &message): std::runtime_error(message) { }
+};
+extern __thread JobContext *current_job;  /* NULL outside of a job */
+FILE *diagnostics();  /* where warnings go: stderr, or the job's stream */
+int serve(FILE *in, FILE *out);
+int run_batch(const char *filename, int num_threads);
+
+void manifest_load(Manifest &m, const std::string &root, const RecursiveOptions &opts);
+bool manifest_is_current(Manifest &m, const std::string &output_name,
+                         const std::vector<FileInfo> &files);
+std::vector<InputStamp> manifest_stamps(const std::vector<FileInfo> &files);
+void manifest_record(Manifest &m, const std::string &output_name,
+                     const std::vector<InputStamp> &stamps);
+void manifest_record_directory(Manifest &m, const std::string &output_name);
+void manifest_save(Manifest &m);
+
+/* Flags computed once per unique line by classify_line(), and
+ * available thereafter as Difdef::Diff::Line::flags. */
+enum {
+    LINE_IS_IF = 0x01,
+    LINE_IS_ELIF = 0x02,
+    LINE_IS_ELSE = 0x04,
+    LINE_IS_ENDIF = 0x08,
+    LINE_IS_DIRECTIVE = 0x0F,
+    LINE_IS_BLANK = 0x10,
+    LINE_OPENS_CONSTRUCT = 0x20,  /* leaves a comment (etc.) open when read from a clean state */
+    /* The CStateMachine::state() after this line, from a clean state
+     * and from inside a comment, respectively. Four bits each. */
+    LINE_CLEAN_EXIT_SHIFT = 8,
+    LINE_COMMENT_EXIT_SHIFT = 12
+};
+
+unsigned short classify_line(const std::string &s);
 void verify_properly_nested_directives(const Difdef::Diff &diff,
                                        const FileInfo files[]);
 bool matches_pp_directive(const std::string &s, const char *directive);
 bool matches_if_directive(const std::string &s);
 bool opens_comment(const std::string &s);
 bool closes_comment(const std::string &s);
-void do_print_using_ifdefs(const Difdef::Diff &diff,
+void do_print_using_ifdefs(Difdef::Diff &diff,  /* modified in place */
                            const std::vector<std::string> &macro_names,
                            bool use_only_simple_ifs,
                            FILE *out);
 void do_print_ifdefs_recursively(std::vector<FileInfo> &files,
-                                 const std::vector<std::string> &macro_names,
-                                 bool use_only_simple_ifs,
+                                 const RecursiveOptions &opts,
                                  const std::string &output_name);
-void do_print_unified_diff(const Difdef::Diff &diff,
+void do_print_unified_diff(const Difdef::EditScript &script,
                            const FileInfo files[],
                            size_t lines_of_context,
                            FILE *out);
+void warn_about_approximations(const Difdef &difdef, const char *filename);
 void do_error(const char *fmt, ...);
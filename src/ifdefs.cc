@@ -20,10 +20,10 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdio>
-#include <stack>
 #include <string>
 #include <vector>
 
@@ -208,32 +208,31 @@ static void emit_endif(mask_t ifmask, mask_t elsemask, mask_t allmask,
  */
 static void coalesce_endifs(Difdef::Diff &diff)
 {
-    for (size_t i=0; i+1 < diff.lines.size(); ++i) {
-        if (!matches_pp_directive(*diff.lines[i].text, "endif"))
-            continue;
-        
-        const mask_t next_block_mask = diff.lines[i+1].mask;
-        if (!disjoint(diff.lines[i].mask, next_block_mask)) {
-            /* We're looking for mutually exclusive blocks. */
-            continue;
-        }
-
-        /* See if the next block also ends in an #endif. */
-        size_t ni = i+1;
-        while (ni+1 < diff.lines.size() && diff.lines[ni+1].mask == next_block_mask)
-            ++ni;
-
-        if (!matches_pp_directive(*diff.lines[ni].text, "endif")) {
-            /* The next block does *not* end in an #endif. */
-            continue;
+    /* Compact in place: "w" is the write cursor, "r" the read cursor. */
+    const size_t n = diff.lines.size();
+    size_t w = 0;
+    for (size_t r = 0; r < n; ) {
+        if (r+1 < n && (diff.lines[r].flags & LINE_IS_ENDIF) &&
+                disjoint(diff.lines[r].mask, diff.lines[r+1].mask)) {
+            /* We're looking at mutually exclusive blocks. See if the
+             * next block also ends in an #endif. */
+            const mask_t next_block_mask = diff.lines[r+1].mask;
+            size_t ni = r+1;
+            while (ni+1 < n && diff.lines[ni+1].mask == next_block_mask)
+                ++ni;
+
+            if (diff.lines[ni].flags & LINE_IS_ENDIF) {
+                /* We have two mutually exclusive blocks both ending in #endif.
+                 * Merge the #endifs, and move on past the merged one. */
+                diff.lines[ni].mask |= diff.lines[r].mask;
+                for (++r; r <= ni; ++r)
+                    diff.lines[w++] = diff.lines[r];
+                continue;
+            }
         }
-
-        /* We have two mutually exclusive blocks both ending in #endif.
-         * Merge the #endifs, and do another iteration. */
-        diff.lines[ni].mask |= diff.lines[i].mask;
-        diff.lines.erase(diff.lines.begin()+i);
-        i = ni-1;
+        diff.lines[w++] = diff.lines[r++];
     }
+    diff.lines.erase(diff.lines.begin() + w, diff.lines.end());
 }
 
 
@@ -243,99 +242,157 @@ static void coalesce_endifs(Difdef::Diff &diff)
  * don't need to do anything. Otherwise, we'll fall back on the guaranteed
  * solution: split out N copies of the entire range, one for each version.
  */
+struct RangeInfo {
+    mask_t clean_before;  // versions not inside a comment (etc.) before this line
+    size_t extent;  // last line of the #if-block or comment (etc.) starting here
+    char directive;  // 'i' for #if, 'l' for #elif, 'e' for #else, 'n' for #endif
+    bool opens_construct;  // this line starts a comment (etc.) in some version
+    bool busy_after;  // some version is inside a comment (etc.) after this line
+};
+
+/* Walk each version through the whole file once, recording where each
+ * #if is matched and where each multi-line construct ends. Every range
+ * examined by split_if_elif_ranges_by_version() starts at a point where
+ * all versions are outside of any comment, so these global answers are
+ * the same ones that a fresh scan from the start of the range would give.
+ */
+static void find_ranges(const Difdef::Diff &diff, std::vector<RangeInfo> &info)
+{
+    const size_t n = diff.lines.size();
+    info.resize(n);
+    CStateGroups states(diff.all_files_mask());
+    std::vector<std::vector<size_t> > open_ifs(diff.dimension);
+    std::vector<size_t> construct_start(diff.dimension);
+
+    for (size_t j=0; j < n; ++j) {
+        const Difdef::Diff::Line &line = diff.lines[j];
+        RangeInfo &r = info[j];
+        r.extent = j;
+        r.directive = (line.flags & LINE_IS_IF) ? 'i' :
+                      (line.flags & LINE_IS_ELIF) ? 'l' :
+                      (line.flags & LINE_IS_ELSE) ? 'e' :
+                      (line.flags & LINE_IS_ENDIF) ? 'n' : '\0';
+        const mask_t was_clean = states.clean() & line.mask;
+        r.clean_before = was_clean;
+        if (r.directive == 'i' || r.directive == 'n') {
+            for (int v=0; v < diff.dimension; ++v) {
+                if (!(was_clean & ((mask_t)1 << v))) continue;
+                if (r.directive == 'i') {
+                    open_ifs[v].push_back(j);
+                } else if (!open_ifs[v].empty()) {
+                    RangeInfo &ri = info[open_ifs[v].back()];
+                    ri.extent = std::max(ri.extent, j);
+                    open_ifs[v].pop_back();
+                }
+            }
+        }
+        states.update(line);
+        const mask_t now_clean = states.clean() & line.mask;
+        const mask_t opened = (was_clean & ~now_clean);
+        const mask_t closed = (now_clean & ~was_clean);
+        r.opens_construct = (opened != 0);
+        if (opened | closed) {
+            for (int v=0; v < diff.dimension; ++v) {
+                if (opened & ((mask_t)1 << v)) {
+                    construct_start[v] = j;
+                } else if (closed & ((mask_t)1 << v)) {
+                    RangeInfo &rc = info[construct_start[v]];
+                    rc.extent = std::max(rc.extent, j);
+                }
+            }
+        }
+        r.busy_after = (states.clean() != diff.all_files_mask());
+    }
+
+    /* Anything left open runs to the end of the file. */
+    for (int v=0; v < diff.dimension; ++v) {
+        if (!(states.clean() & ((mask_t)1 << v)))
+            info[construct_start[v]].extent = n-1;
+        for (size_t k=0; k < open_ifs[v].size(); ++k)
+            info[open_ifs[v][k]].extent = n-1;
+    }
+}
+
 static void split_if_elif_ranges_by_version(Difdef::Diff &diff)
 {
-    for (size_t i=0; i < diff.lines.size(); ++i) {
-        const std::string &text = *diff.lines[i].text;
-        CStateMachine state_machine(text);
-        if (!matches_if_directive(text) && !state_machine.in_something())
+    std::vector<RangeInfo> info;
+    find_ranges(diff, info);
+
+    /* Lines are copied into "result" as we go, so that splitting a
+     * range never has to shift the rest of the file. */
+    Difdef::Diff::Lines result;
+    result.reserve(diff.lines.size());
+
+    const size_t n = diff.lines.size();
+    for (size_t i=0; i < n; ++i) {
+        if (info[i].directive != 'i' && !info[i].opens_construct) {
+            result.push_back(diff.lines[i]);
             continue;
-        
-        size_t end_of_initial_multiline_construct =
-            (state_machine.in_something() ? diff.lines.size() : i);
+        }
+
+        /* We have an #if, or a comment. The range ends at the first line
+         * after which every version is back out of every #if-block and
+         * comment that started inside the range. */
+        size_t last = i;
+        for (size_t j = i; j <= last; ++j)
+            last = std::max(last, info[j].extent);
+        const size_t end_of_range = last+1;
 
-        /* We have an #if, or a comment. See if its range is all under
-         * the same mask. */
+        /* The range must contain at least two lines. */
+        assert(i+1 < end_of_range && end_of_range <= n);
+
+        /* See if the range is all under the same mask. */
+        size_t end_of_initial_multiline_construct = (info[i].opens_construct ? n : i);
         bool need_to_split = false;
-        size_t end_of_range = diff.lines.size();
-        mask_t desired_mask = diff.lines[i].mask;
-        std::vector<std::stack<char> > nest(diff.dimension);
-        std::vector<CStateMachine> state_machines(diff.dimension);
-        for (size_t j = i; j < diff.lines.size(); ++j) {
-            if (!contains(desired_mask, diff.lines[j].mask)) {
+        const mask_t desired_mask = diff.lines[i].mask;
+        int nest[Difdef::MAX_FILES] = {};
+        for (size_t j = i; j < end_of_range && !need_to_split; ++j) {
+            const mask_t mask = diff.lines[j].mask;
+            if (!contains(desired_mask, mask)) {
                 need_to_split = true;
             }
-            const std::string &text = *diff.lines[j].text;
-            const bool is_if = matches_if_directive(text);
-            const bool is_elif = matches_pp_directive(text, "elif");
-            const bool is_else = matches_pp_directive(text, "else");
-            const bool is_endif = matches_pp_directive(text, "endif");
-            const bool is_any_pp = is_if || is_elif || is_else || is_endif;
-
-            for (int v=0; v < diff.dimension; ++v) {
-                if (!diff.lines[j].in_file(v)) continue;
-                if (!state_machines[v].in_something()) {
+            const char directive = info[j].directive;
+            if (directive != '\0') {
+                for (int v=0; v < diff.dimension; ++v) {
+                    if (!(info[j].clean_before & ((mask_t)1 << v))) continue;
                     /* All top-level pp-directives in the range must have the same mask. */
-                    if (is_any_pp && (diff.lines[j].mask != desired_mask)) {
-                        if (nest[v].size() == (is_if ? 0 : 1))
-                            need_to_split = true;
-                    }
-                    if (is_if) {
-                        nest[v].push('i');
-                    } else if (is_else) {
-                        assert(nest[v].top() == 'i');
-                        nest[v].top() = 'e';
-                    } else if (is_endif) {
-                        assert(!nest[v].empty());
-                        nest[v].pop();
+                    if (mask != desired_mask && nest[v] == (directive == 'i' ? 0 : 1))
+                        need_to_split = true;
+                    if (directive == 'i') {
+                        nest[v] += 1;
+                    } else if (directive == 'n') {
+                        assert(nest[v] > 0);
+                        nest[v] -= 1;
                     }
                 }
-                state_machines[v].update(text);
-            }
-
-            bool someone_is_in_pp_nest = false;
-            bool someone_is_in_multiline_construct = false;
-            for (int v=0; v < diff.dimension; ++v) {
-                if (state_machines[v].in_something())
-                    someone_is_in_multiline_construct = true;
-                if (!nest[v].empty())
-                    someone_is_in_pp_nest = true;
             }
-            
-            if (someone_is_in_multiline_construct) {
-                if (j < diff.lines.size() &&
-                        diff.lines[j].mask != diff.lines[j+1].mask) {
+            if (info[j].busy_after) {
+                if (j+1 < n && mask != diff.lines[j+1].mask)
                     need_to_split = true;
-                }
             } else {
                 end_of_initial_multiline_construct =
                     std::min(end_of_initial_multiline_construct, j);
-                if (!someone_is_in_pp_nest) {
-                    end_of_range = j+1;
-                    break;
-                }
             }
         }
 
-        /* The range must contain at least two lines. */
-        assert(i+1 < end_of_range && end_of_range <= diff.lines.size());
-
         if (need_to_split) {
-            std::vector<std::vector<const std::string *> > split_versions(diff.dimension);
+            std::vector<std::vector<Difdef::Diff::Line> > split_versions(diff.dimension);
             for (size_t j = i; j < end_of_range; ++j) {
                 for (int v=0; v < diff.dimension; ++v) {
                     if (!diff.lines[j].in_file(v)) continue;
-                    split_versions[v].push_back(diff.lines[j].text);
+                    split_versions[v].push_back(diff.lines[j]);
                 }
             }
             Difdef::Diff split_merge = Difdef::simply_concatenate(split_versions);
-            diff.lines.erase(diff.lines.begin()+i, diff.lines.begin()+end_of_range);
-            diff.lines.insert(diff.lines.begin()+i, split_merge.lines.begin(), split_merge.lines.end());
-            i += split_merge.lines.size()-1;
+            result.insert(result.end(), split_merge.lines.begin(), split_merge.lines.end());
+            i = end_of_range-1;
         } else {
+            const size_t end_of_copy = std::min(end_of_initial_multiline_construct+1, n);
+            result.insert(result.end(), diff.lines.begin()+i, diff.lines.begin()+end_of_copy);
             i = end_of_initial_multiline_construct;
         }
     }
+    diff.lines.swap(result);
 }
 
 
@@ -357,20 +414,25 @@ static void split_if_elif_ranges_by_version(Difdef::Diff &diff)
  */
 static void collapse_blank_lines(Difdef::Diff &diff)
 {
-    for (size_t i=0; i < diff.lines.size(); ++i) {
-        Difdef::Diff::Line &line = diff.lines[i];
-        const bool is_blank_line = (*line.text == "");
-        if (!is_blank_line) continue;
+    /* Compact in place: "w" is the write cursor, "r" the read cursor. */
+    const size_t n = diff.lines.size();
+    size_t w = 0;
+    for (size_t r = 0; r < n; ) {
+        const bool is_blank_line = (diff.lines[r].flags & LINE_IS_BLANK);
+        if (!is_blank_line) {
+            diff.lines[w++] = diff.lines[r++];
+            continue;
+        }
         /* Find this series of blank lines. */
-        size_t end = i;
-        while (end < diff.lines.size() && *diff.lines[end].text == "") ++end;
+        size_t end = r;
+        while (end < n && (diff.lines[end].flags & LINE_IS_BLANK)) ++end;
         /* Look at the lines on either side. */
-        mask_t startmask = (i > 0) ? diff.lines[i-1].mask : diff.all_files_mask();
-        mask_t endmask = (end < diff.lines.size()) ? diff.lines[end].mask : diff.all_files_mask();
-        int blank_lines_we_still_want = 0;
+        mask_t startmask = (w > 0) ? diff.lines[w-1].mask : diff.all_files_mask();
+        mask_t endmask = (end < n) ? diff.lines[end].mask : diff.all_files_mask();
+        size_t blank_lines_we_still_want = 0;
         if (startmask == endmask) {
             /* Preserve these blank lines; they don't border an #ifdef. */
-            for (size_t j = i; j < end; ++j) {
+            for (size_t j = r; j < end; ++j) {
                 if (contains(diff.lines[j].mask, startmask)) {
                     /* This blank line appears in a superset of startmask. */
                     ++blank_lines_we_still_want;
@@ -380,26 +442,29 @@ static void collapse_blank_lines(Difdef::Diff &diff)
             /* There will be an #if here. Reduce N blank lines to 1. */
             blank_lines_we_still_want = 1;
         }
-        for (size_t j = i; j < i + blank_lines_we_still_want; ++j) {
-            diff.lines[j].mask = (startmask | endmask);
+        for (size_t j = r; j < r + blank_lines_we_still_want; ++j) {
+            diff.lines[w] = diff.lines[j];
+            diff.lines[w].mask = (startmask | endmask);
+            ++w;
         }
-        diff.lines.erase(diff.lines.begin() + i + blank_lines_we_still_want,
-                         diff.lines.begin() + end);
-        i += blank_lines_we_still_want-1;
+        r = end;
     }
+    diff.lines.erase(diff.lines.begin() + w, diff.lines.end());
 }
 
 
-void do_print_using_ifdefs(const Difdef::Diff &diff_,
+void do_print_using_ifdefs(Difdef::Diff &diff,
                            const std::vector<std::string> &macro_names,
                            bool use_only_simple_ifs,
                            FILE *out)
 {
-    Difdef::Diff diff(diff_);
-
+    /* These passes rewrite "diff" in place; each is a single linear pass. */
+    const unsigned long long start = (run_stats != NULL) ? stats_clock() : 0;
     coalesce_endifs(diff);
     split_if_elif_ranges_by_version(diff);
     collapse_blank_lines(diff);
+    const unsigned long long render_start = (run_stats != NULL) ? stats_clock() : 0;
+    unsigned long num_directives = 0;
 
     std::vector<mask_t> ifstack;
     std::vector<mask_t> elsestack;
@@ -432,14 +497,17 @@ void do_print_using_ifdefs(const Difdef::Diff &diff_,
                     ifstack.back() = new_mask;
                     if (elsestack.back() == (next_higher_mask & ~new_mask)) {
                         emit_else(new_mask, macro_names, out);
+                        ++num_directives;
                     } else {
                         emit_elif(new_mask, macro_names, out);
+                        ++num_directives;
                     }
                     break;
                 }
             }
             emit_endif(ifstack.back(), elsestack.back(),
                        diff.all_files_mask(), macro_names, out);
+            ++num_directives;
             ifstack.resize(ifstack.size()-1);
             elsestack.resize(elsestack.size()-1);
             assert(!ifstack.empty());
@@ -449,6 +517,7 @@ void do_print_using_ifdefs(const Difdef::Diff &diff_,
             ifstack.push_back(new_mask);
             elsestack.push_back(0);
             emit_ifdef(new_mask, macro_names, out);
+            ++num_directives;
         }
         fprintf(out, "%s\n", line.text->c_str());
     }
@@ -456,6 +525,12 @@ void do_print_using_ifdefs(const Difdef::Diff &diff_,
     for (size_t k = ifstack.size(); k > 1; --k) {
         emit_endif(ifstack[k-1], elsestack[k-1],
                    diff.all_files_mask(), macro_names, out);
+        ++num_directives;
+    }
+    if (run_stats != NULL) {
+        run_stats->postprocess_ns += render_start - start;
+        run_stats->render_ns += stats_clock() - render_start;
+        run_stats->lines_emitted += diff.lines.size() + num_directives;
     }
 }
 
@@ -27,6 +27,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <new>
 #include <string>
 #include <vector>
 
@@ -36,11 +37,33 @@
 
 typedef Difdef::mask_t mask_t;
 
+/* See set_cost_budget(). The bit-parallel LCS never costs this much, so
+ * only regions that would need the memoized LCS are approximated. For
+ * two 6000-line files of that kind, the exact merge ran out of memory
+ * after 80 s, and the approximate one took 0.2 s. */
+static const unsigned long long SPEED_LARGE_FILES_BUDGET = 500000000ULL;
+
+/* How many files --trace lists at the end. */
+static const size_t TRACE_SLOWEST_FILES = 10;
+
+
+__thread JobContext *current_job = NULL;
+
+FILE *diagnostics()
+{
+    return (current_job != NULL) ? current_job->err : stderr;
+}
 
 void do_error(const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
+    if (current_job != NULL) {
+        char message[1024];
+        vsnprintf(message, sizeof message, fmt, ap);
+        va_end(ap);
+        throw JobError(message);
+    }
     fputs("ERROR: ", stderr);
     vfprintf(stderr, fmt, ap);
     putc('\n', stderr);
@@ -48,6 +71,16 @@ void do_error(const char *fmt, ...)
     exit(EXIT_FAILURE);
 }
 
+void warn_about_approximations(const Difdef &difdef, const char *filename)
+{
+    const int n = difdef.num_approximations();
+    if (n != 0) {
+        fprintf(diagnostics(), "WARNING: %s%s%d region(s) were too costly to diff exactly;\n"
+                        "an approximate (possibly longer) diff was used there.\n",
+                (filename ? filename : ""), (filename ? ": " : ""), n);
+    }
+}
+
 static void do_help()
 {
     puts("Usage: difdef [OPTION]... FILE1 [FILE2 FILE3]...");
@@ -58,9 +91,34 @@ static void do_help()
     puts("  --if EXPR                  As above, but using arbitrary #if syntax.");
     puts("  -D NAME=VALUE              Equivalent to --if NAME==VALUE.");
     puts("      --complex (--simple)   Use (do not use) #elif and #else constructs.");
+    puts("      --batch=FILE           Run the jobs listed in FILE, one command line per");
+    puts("                             line, in one process; -j NUM runs NUM at a time.");
+    puts("      --binary=POLICY        In recursive ifdef mode, what to do with differing");
+    puts("                             binary files: skip (the default), error, or text.");
+    puts("  -j NUM      --jobs=NUM     Use up to NUM threads to read and merge files.");
+    puts("      --merge-order=ORDER    Merge the files in the ORDER given (the default),");
+    puts("                             or starting from the most similar ones first.");
+    puts("      --max-memory=SIZE      Fail cleanly rather than let the merge use more");
+    puts("                             than SIZE bytes (suffixes K, M, G) of memory.");
     puts("  -o  --output=FILE          Write result to FILE instead of standard output.");
     puts("  -r  --recursive            Recursively compare subdirectories.");
+    puts("      --link-identical       In recursive ifdef mode, hard-link (rather than");
+    puts("                             copy) files whose versions are all identical.");
+    puts("      --server               Run the jobs framed on standard input one after");
+    puts("                             another, in one process; see server.cc.");
+    puts("      --speed-large-files    Bound the time spent on large differing regions,");
+    puts("                             at the cost of a possibly suboptimal diff there.");
+    puts("      --stats[=FORMAT]       Report time spent per phase, and other counters,");
+    puts("                             to standard error as text (default) or json.");
+    puts("      --trace=FILE           In recursive ifdef mode, write the time spent on");
+    puts("                             each file to FILE as Chrome trace events, and");
+    puts("                             list the slowest files on standard error.");
     puts("  -t                         Expand tabs and strip trailing whitespace.");
+    puts("      --update               In recursive ifdef mode, update an existing output");
+    puts("                             directory, regenerating only files whose inputs");
+    puts("                             have changed since the last --update run.");
+    puts("      --window=NUM           In raw mode, merge NUM lines of each file at a");
+    puts("                             time, so that huge files needn't fit in memory.");
     puts("");
     puts("  --help  Output this help.");
     puts("");
@@ -90,6 +148,7 @@ static void do_print_multicolumn(const Difdef::Diff &diff, FILE *out)
      * eminently greppable.
      */
     static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEF";
+    const unsigned long long start = (run_stats != NULL) ? stats_clock() : 0;
     for (size_t i=0; i < diff.lines.size(); ++i) {
         const Difdef::Diff::Line &line = diff.lines[i];
         for (int j=0; j < diff.dimension; ++j) {
@@ -97,6 +156,33 @@ static void do_print_multicolumn(const Difdef::Diff &diff, FILE *out)
         }
         fprintf(out, "%s\n", line.text->c_str());
     }
+    if (run_stats != NULL) {
+        run_stats->render_ns += stats_clock() - start;
+        run_stats->lines_emitted += diff.lines.size();
+    }
+}
+
+
+static void print_multicolumn_chunk(const Difdef::Diff &diff, void *out)
+{
+    do_print_multicolumn(diff, static_cast<FILE *>(out));
+}
+
+
+static FILE *open_output_file(const char *output_filename, FILE *standard_output)
+{
+    FILE *out = standard_output;
+    if (output_filename != NULL) {
+        if (!strcmp(output_filename, "-")) {
+            /* Explicitly write to standard output. */
+        } else {
+            out = fopen(output_filename, "w");
+            if (out == NULL) {
+                do_error("Output file '%s': Cannot create file", output_filename);
+            }
+        }
+    }
+    return out;
 }
 
 
@@ -119,44 +205,145 @@ static std::string do_normalize_whitespace(const std::string &line)
 }
 
 
-int main(int argc, char **argv)
+/* Parse "SIZE" for --max-memory: a number of bytes, optionally
+ * followed by K, M or G for binary kilobytes etc. */
+static size_t parse_memory_size(const char *arg)
 {
-    std::vector<std::string> user_defined_macro_names;
-    const char *output_filename = NULL;
-    bool print_using_ifdefs = false;
-    bool print_unified_diff = false;
-    bool print_recursively = false;
-    bool use_only_simple_ifs = true;
-    bool normalize_whitespace = false;
-    size_t lines_of_context = 0;
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; ++end; break;
+        case 'M': case 'm': shift = 20; ++end; break;
+        case 'G': case 'g': shift = 30; ++end; break;
+    }
+    if (end == arg || *end != '\0' || value == 0 || value > ((size_t)-1 >> shift)) {
+        do_error("invalid memory size '%s'", arg);
+    }
+    return (size_t)value << shift;
+}
+
 
+/* Parse a command line (or a --server job's arguments) into "opts",
+ * checking that the options make sense together. */
+void parse_options(int argc, char **argv, Options &opts)
+{
     static const struct option longopts[] = {
+        { "batch", required_argument, NULL, 0 },
+        { "binary", required_argument, NULL, 0 },
         { "complex", no_argument, NULL, 0 },
         { "if", required_argument, NULL, 0 },
         { "ifdef", required_argument, NULL, 'D' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "link-identical", no_argument, NULL, 0 },
+        { "max-memory", required_argument, NULL, 0 },
+        { "merge-order", required_argument, NULL, 0 },
         { "output", required_argument, NULL, 'o' },
         { "recursive", no_argument, NULL, 'r' },
+        { "server", no_argument, NULL, 0 },
         { "simple", no_argument, NULL, 0 },
+        { "speed-large-files", no_argument, NULL, 0 },
+        { "stats", optional_argument, NULL, 0 },
+        { "trace", required_argument, NULL, 0 },
         { "unified", no_argument, NULL, 'u' },
+        { "update", no_argument, NULL, 0 },
+        { "window", required_argument, NULL, 0 },
         { "help", no_argument, NULL, 0 },
+        { NULL, 0, NULL, 0 },
     };
     int c;
     int longopt_index;
+    int num_options = 0;
+    int num_jobs_options = 0;
     bool preceded_by_digit = false;
     size_t ocontext = -1;
-    while ((c = getopt_long(argc, argv, "0123456789D:o:rtuU:", longopts, &longopt_index)) != -1) {
+    /* Start afresh, in case this isn't the first command line we parse.
+     * A job's mistakes are reported to the job, not to our stderr. */
+    optind = 0;
+    opterr = (current_job == NULL);
+    while ((c = getopt_long(argc, argv, "0123456789D:j:o:rtuU:", longopts, &longopt_index)) != -1) {
         switch (c) {
             case 0:
                 if (!strcmp(longopts[longopt_index].name, "help")) {
+                    if (current_job != NULL) {
+                        do_error("--help is not available in a %s job", current_job->mode);
+                    }
                     do_help();
+                } else if (!strcmp(longopts[longopt_index].name, "batch")) {
+                    if (current_job != NULL) {
+                        do_error("--batch is not available in a %s job", current_job->mode);
+                    }
+                    assert(optarg != NULL);
+                    opts.batch_filename = optarg;
+                } else if (!strcmp(longopts[longopt_index].name, "binary")) {
+                    assert(optarg != NULL);
+                    if (!strcmp(optarg, "skip")) {
+                        opts.binary_policy = BINARY_SKIP;
+                    } else if (!strcmp(optarg, "error")) {
+                        opts.binary_policy = BINARY_ERROR;
+                    } else if (!strcmp(optarg, "text")) {
+                        opts.binary_policy = BINARY_TEXT;
+                    } else {
+                        do_error("invalid argument '%s' for --binary", optarg);
+                    }
+                } else if (!strcmp(longopts[longopt_index].name, "merge-order")) {
+                    assert(optarg != NULL);
+                    if (!strcmp(optarg, "given")) {
+                        opts.merge_by_similarity = false;
+                    } else if (!strcmp(optarg, "similarity")) {
+                        opts.merge_by_similarity = true;
+                    } else {
+                        do_error("invalid argument '%s' for --merge-order", optarg);
+                    }
                 } else if (!strcmp(longopts[longopt_index].name, "if")) {
-                    print_using_ifdefs = true;
+                    opts.print_using_ifdefs = true;
                     assert(optarg != NULL);
-                    user_defined_macro_names.push_back(optarg);
+                    opts.macro_names.push_back(optarg);
                 } else if (!strcmp(longopts[longopt_index].name, "complex")) {
-                    use_only_simple_ifs = false;
+                    opts.use_only_simple_ifs = false;
                 } else if (!strcmp(longopts[longopt_index].name, "simple")) {
-                    use_only_simple_ifs = true;
+                    opts.use_only_simple_ifs = true;
+                } else if (!strcmp(longopts[longopt_index].name, "speed-large-files")) {
+                    opts.cost_budget = SPEED_LARGE_FILES_BUDGET;
+                } else if (!strcmp(longopts[longopt_index].name, "stats")) {
+                    opts.want_stats = true;
+                    if (optarg == NULL || !strcmp(optarg, "text")) {
+                        opts.stats_as_json = false;
+                    } else if (!strcmp(optarg, "json")) {
+                        opts.stats_as_json = true;
+                    } else {
+                        do_error("invalid argument '%s' for --stats", optarg);
+                    }
+                } else if (!strcmp(longopts[longopt_index].name, "trace")) {
+                    /* There is only one tracer. */
+                    if (current_job != NULL && !strcmp(current_job->mode, "--batch")) {
+                        do_error("--trace is not available in a --batch job");
+                    }
+                    assert(optarg != NULL);
+                    opts.trace_filename = optarg;
+                } else if (!strcmp(longopts[longopt_index].name, "link-identical")) {
+                    opts.link_identical = true;
+                } else if (!strcmp(longopts[longopt_index].name, "max-memory")) {
+                    /* The limit is the process's, not a job's. */
+                    if (current_job != NULL && !strcmp(current_job->mode, "--batch")) {
+                        do_error("--max-memory is not available in a --batch job");
+                    }
+                    assert(optarg != NULL);
+                    opts.max_memory = parse_memory_size(optarg);
+                } else if (!strcmp(longopts[longopt_index].name, "server")) {
+                    if (current_job != NULL) {
+                        do_error("--server is not available in a %s job", current_job->mode);
+                    }
+                    opts.serve = true;
+                } else if (!strcmp(longopts[longopt_index].name, "update")) {
+                    opts.update_in_place = true;
+                } else if (!strcmp(longopts[longopt_index].name, "window")) {
+                    assert(optarg != NULL);
+                    char *end;
+                    opts.window_lines = strtoul(optarg, &end, 10);
+                    if (*end != '\0' || opts.window_lines == 0) {
+                        do_error("invalid window size '%s'", optarg);
+                    }
                 } else {
                     assert(false);
                 }
@@ -173,7 +360,7 @@ int main(int argc, char **argv)
                 }
                 break;
             case 'D': {
-                print_using_ifdefs = true;
+                opts.print_using_ifdefs = true;
                 assert(optarg != NULL);
                 const char *equals = strchr(optarg, '=');
                 std::string expression;
@@ -183,49 +370,98 @@ int main(int argc, char **argv)
                 } else {
                     expression = std::string(BUILTIN_DEFINE) + optarg;
                 }
-                user_defined_macro_names.push_back(expression);
+                opts.macro_names.push_back(expression);
+                break;
+            }
+            case 'j': {
+                assert(optarg != NULL);
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*end != '\0' || value < 1 || value > 1024) {
+                    do_error("invalid number of jobs '%s'", optarg);
+                }
+                opts.num_threads = value;
+                num_jobs_options += 1;
                 break;
             }
             case 'o': {
                 assert(optarg != NULL);
-                output_filename = optarg;
+                opts.output_filename = optarg;
                 break;
             }
             case 'r': {
-                print_recursively = true;
+                opts.print_recursively = true;
                 break;
             }
             case 't': {
-                normalize_whitespace = true;
+                opts.normalize_whitespace = true;
                 break;
             }
             case 'U':
             case 'u':
-                print_unified_diff = true;
+                opts.print_unified_diff = true;
                 if (optarg != NULL) {
                     char *end;
                     size_t value = strtoul(optarg, &end, 10);
                     if (end == NULL || *end != '\0') {
                         do_error("invalid context length '%s'", optarg);
                     }
-                    lines_of_context = std::max(lines_of_context, value);
+                    opts.lines_of_context = std::max(opts.lines_of_context, value);
                 } else {
-                    lines_of_context = std::max<size_t>(lines_of_context, 3);
+                    opts.lines_of_context = std::max<size_t>(opts.lines_of_context, 3);
+                }
+                break;
+            case '?':
+                if (current_job != NULL) {
+                    do_error("invalid option '%s'", argv[optind-1]);
                 }
                 break;
         }
         preceded_by_digit = isdigit(c);
+        num_options += 1;
     }
 
     if (ocontext != (size_t)-1) {
-        lines_of_context = ocontext;
+        opts.lines_of_context = ocontext;
     }
 
     assert(optind <= argc);
-    const int num_files = argc - optind;
-    const int num_user_defined_macros = user_defined_macro_names.size();
+    opts.file_names.assign(argv + optind, argv + argc);
+    if (opts.serve) {
+        if (num_options != 1 + (opts.max_memory != 0) || !opts.file_names.empty()) {
+            do_error("--server takes no files, and no other options than --max-memory");
+        }
+        return;
+    }
+    if (opts.batch_filename != NULL) {
+        if (num_options != 1 + (opts.max_memory != 0) + num_jobs_options || !opts.file_names.empty()) {
+            do_error("--batch takes no files, and no other options than -j and --max-memory");
+        }
+        return;
+    }
+    if (current_job != NULL) {
+        for (size_t i=0; i < opts.file_names.size(); ++i) {
+            if (opts.file_names[i] == "-")
+                do_error("standard input is not available in a %s job", current_job->mode);
+        }
+    }
+    if (opts.buffers != NULL) {
+        if (!opts.file_names.empty()) {
+            do_error("a job with input buffers must not also name input files");
+        }
+        for (size_t i=0; i < opts.buffers->size(); ++i) {
+            char name[32];
+            sprintf(name, "(buffer %d)", (int)i+1);
+            opts.file_names.push_back(name);
+        }
+        if (opts.print_recursively || opts.window_lines != 0) {
+            do_error("-r and --window need input files, not buffers");
+        }
+    }
+    const int num_files = opts.file_names.size();
+    const int num_user_defined_macros = opts.macro_names.size();
 
-    if (print_unified_diff && print_using_ifdefs) {
+    if (opts.print_unified_diff && opts.print_using_ifdefs) {
         do_error("options --unified/-u/-U and --if/-D are mutually exclusive");
     }
 
@@ -233,11 +469,11 @@ int main(int argc, char **argv)
         do_error("no files provided");
     }
 
-    if (print_unified_diff && num_files != 2) {
+    if (opts.print_unified_diff && num_files != 2) {
         do_error("unified diff requires exactly two files");
     }
 
-    if (print_using_ifdefs) {
+    if (opts.print_using_ifdefs) {
         assert(num_user_defined_macros >= 1);
         if (num_user_defined_macros == num_files) {
             /* it's okay */
@@ -250,96 +486,206 @@ int main(int argc, char **argv)
         }
     }
 
-    if (print_recursively) {
-        if (print_using_ifdefs) {
-            if (output_filename == NULL) {
+    if (opts.print_recursively) {
+        if (opts.print_using_ifdefs) {
+            if (opts.output_filename == NULL) {
                 do_error("Recursive #ifdef merge requires an output directory");
-            } else if (!strcmp(output_filename, "-")) {
+            } else if (!strcmp(opts.output_filename, "-")) {
                 do_error("Output path '-' is not a directory");
             }
-        } else if (print_unified_diff) {
+        } else if (opts.print_unified_diff) {
             /* it's okay */
         } else {
             do_error("Recursive diff requires either --ifdef or --unified");
         }
     }
 
+    if (opts.update_in_place && !(opts.print_recursively && opts.print_using_ifdefs)) {
+        do_error("--update requires recursive ifdef mode");
+    }
+    if (opts.trace_filename != NULL && !(opts.print_recursively && opts.print_using_ifdefs)) {
+        do_error("--trace requires recursive ifdef mode");
+    }
+
+    if (opts.window_lines != 0 && (opts.print_using_ifdefs || opts.print_unified_diff || opts.print_recursively)) {
+        do_error("--window is supported only in the default (raw) output mode");
+    }
+}
+
+
+/* Do what "opts" asks, writing to "standard_output" unless it asks for
+ * an output file. */
+void run_job(const Options &opts, FILE *standard_output)
+{
+    const int num_files = opts.file_names.size();
+    RunStats stats;
+    if (opts.want_stats) {
+        run_stats = &stats;
+    }
+
     Difdef difdef(num_files);
-    if (normalize_whitespace) {
+    difdef.set_line_pool(opts.line_pool);
+    if (opts.normalize_whitespace) {
         difdef.set_filter(do_normalize_whitespace);
     }
+    if (opts.print_using_ifdefs) {
+        difdef.set_classifier(classify_line);
+    }
+    if (!opts.print_recursively) {
+        difdef.set_num_threads(opts.num_threads);
+    }
+    difdef.set_cost_budget(opts.cost_budget);
+    difdef.set_merge_by_similarity(opts.merge_by_similarity);
+    if (run_stats != NULL) {
+        difdef.set_stats(&run_stats->engine);
+    }
 
     std::vector<FileInfo> files(num_files);
+    FilesCloser files_closer(files);
 
     for (int i=0; i < num_files; ++i) {
-        files[i].name = argv[optind + i];
-        if (files[i].name == "-") {
+        files[i].name = opts.file_names[i];
+        if (opts.buffers != NULL) {
+            const std::string &buffer = (*opts.buffers)[i];
+            files[i].stat.st_size = buffer.size();
+            difdef.replace_buffer(i, buffer.data(), buffer.size());
+        } else if (files[i].name == "-") {
             /* Note that "-" always means stdin. If you have a file named
              * "-" in the current directory, you must use "./-". */
-            if (print_recursively) {
+            if (opts.print_recursively) {
                 do_error("Cannot compare '-' recursively");
             }
-            difdef.replace_file(i, stdin);
             fstat(fileno(stdin), &files[i].stat);
+            files[i].fp = stdin;
         } else {
             const char *fname = files[i].name.c_str();
             FILE *in = fopen(fname, "r");
             if (in == NULL) {
                 do_error("Input %s '%s': No such file or directory",
-                         print_recursively ? "path" : "file",
+                         opts.print_recursively ? "path" : "file",
                          files[i].name.c_str());
             }
             files[i].fp = in;
             fstat(fileno(in), &files[i].stat);
             const bool is_directory = S_ISDIR(files[i].stat.st_mode);
-            if (is_directory && !print_recursively) {
+            if (is_directory && !opts.print_recursively) {
                 do_error("Input file '%s' is a directory", fname);
-            } else if (print_recursively && !is_directory) {
+            } else if (opts.print_recursively && !is_directory) {
                 do_error("Input path '%s' is not a directory", fname);
             }
-            if (!print_recursively) {
-                difdef.replace_file(i, in);
-                fclose(in);
-            }
         }
     }
 
-    if (print_using_ifdefs && print_recursively) {
+    if (opts.buffers == NULL && !opts.print_recursively && opts.window_lines == 0) {
+        /* With -j, the files are read in parallel. */
+        std::vector<FILE *> ins(num_files);
+        for (int i=0; i < num_files; ++i) {
+            ins[i] = files[i].fp;
+        }
+        difdef.replace_files(&ins[0]);
+        close_files(files);
+    }
+
+    if (opts.print_using_ifdefs && opts.print_recursively) {
         /* If we're doing "difdef -r", then files[] is populated with
          * open file descriptors for all the input directories. */
-        assert(output_filename != NULL);        
-        do_print_ifdefs_recursively(files, user_defined_macro_names,
-                                    use_only_simple_ifs, output_filename);
-    } else if (print_unified_diff && print_recursively) {
+        assert(opts.output_filename != NULL);
+        RecursiveOptions ropts;
+        ropts.macro_names = opts.macro_names;
+        ropts.use_only_simple_ifs = opts.use_only_simple_ifs;
+        ropts.link_identical = opts.link_identical;
+        ropts.num_threads = opts.num_threads;
+        ropts.cost_budget = opts.cost_budget;
+        ropts.merge_by_similarity = opts.merge_by_similarity;
+        ropts.binary_policy = opts.binary_policy;
+        ropts.line_pool = opts.line_pool;
+        ropts.manifest = NULL;
+        if (opts.trace_filename != NULL) {
+            trace_open(opts.trace_filename);
+        }
+        if (opts.update_in_place) {
+            Manifest manifest;
+            manifest_load(manifest, opts.output_filename, ropts);
+            ropts.manifest = &manifest;
+            do_print_ifdefs_recursively(files, ropts, opts.output_filename);
+            manifest_save(manifest);
+        } else {
+            do_print_ifdefs_recursively(files, ropts, opts.output_filename);
+        }
+        if (tracer != NULL) {
+            trace_close(TRACE_SLOWEST_FILES, diagnostics());
+        }
+    } else if (opts.print_unified_diff && opts.print_recursively) {
         do_error("Not implemented yet -- TODO FIXME BUG HACK");
+    } else if (opts.window_lines != 0) {
+        /* Merge the files a window at a time, printing as we go. */
+        FILE *out = open_output_file(opts.output_filename, standard_output);
+        FileCloser out_closer(out, standard_output);
+        std::vector<FILE *> ins(num_files);
+        for (int i=0; i < num_files; ++i) {
+            ins[i] = files[i].fp;
+        }
+        size_t num_fallbacks = difdef.merge_streaming(&ins[0], opts.window_lines,
+                                                      print_multicolumn_chunk, out);
+        close_files(files);
+        if (num_fallbacks != 0) {
+            fprintf(diagnostics(), "WARNING: found no shared unique line in %d window(s) of %d lines;\n"
+                                   "the merge may be poor near those window boundaries.\n",
+                    (int)num_fallbacks, (int)opts.window_lines);
+        }
+        warn_about_approximations(difdef, NULL);
+    } else if (opts.print_unified_diff) {
+        /* The two-file case doesn't need the general N-way merge. */
+        Difdef::EditScript script = difdef.edit_script(0, 1);
+        warn_about_approximations(difdef, NULL);
+        FILE *out = open_output_file(opts.output_filename, standard_output);
+        FileCloser out_closer(out, standard_output);
+        do_print_unified_diff(script, &files[0], opts.lines_of_context, out);
     } else {
         /* If we're doing "difdef" without "-r", difdef is populated. */
         Difdef::Diff diff = difdef.merge();
-    
+        warn_about_approximations(difdef, NULL);
+
         /* Try to open the output file. */
-        FILE *out = stdout;
-        if (output_filename != NULL) {
-            if (!strcmp(output_filename, "-")) {
-                /* Explicitly write to stdout. */
-            } else {
-                out = fopen(output_filename, "w");
-                if (out == NULL) {
-                    do_error("Output file '%s': Cannot create file", output_filename);
-                }
-            }
-        }
-    
+        FILE *out = open_output_file(opts.output_filename, standard_output);
+        FileCloser out_closer(out, standard_output);
+
         /* Print out the diff. */
-        if (print_unified_diff) {
-            do_print_unified_diff(diff, &files[0], lines_of_context, out);
-        } else if (print_using_ifdefs) {
+        if (opts.print_using_ifdefs) {
             verify_properly_nested_directives(diff, &files[0]);
-            do_print_using_ifdefs(diff, user_defined_macro_names,
-                                  use_only_simple_ifs, out);
+            do_print_using_ifdefs(diff, opts.macro_names,
+                                  opts.use_only_simple_ifs, out);
         } else {
             do_print_multicolumn(diff, out);
         }
     }
 
+    if (run_stats != NULL) {
+        print_stats(*run_stats, opts.stats_as_json, diagnostics());
+        run_stats = NULL;
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    try {
+        Options opts;
+        parse_options(argc, argv, opts);
+        Difdef::set_memory_limit(opts.max_memory);
+        if (opts.serve) {
+            return serve(stdin, stdout);
+        }
+        if (opts.batch_filename != NULL) {
+            return run_batch(opts.batch_filename, opts.num_threads);
+        }
+        run_job(opts, stdout);
+    } catch (const std::bad_alloc &) {
+        if (Difdef::memory_limit() != 0) {
+            do_error("Out of memory: the merge needs more than --max-memory=%lu bytes",
+                     (unsigned long)Difdef::memory_limit());
+        }
+        do_error("Out of memory");
+    }
     return 0;
 }
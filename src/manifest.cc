@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "diffn.h"
+#include "getline.h"
+
+#define MANIFEST_NAME ".difdef-manifest"
+#define MANIFEST_VERSION "difdef-manifest 1"
+
+
+/* FNV-1a, 64-bit. We don't need anything cryptographic; a collision
+ * merely means we'd fail to regenerate one output file. */
+static unsigned long long hash_bytes(unsigned long long h, const char *p, size_t n)
+{
+    for (size_t i=0; i < n; ++i) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static const unsigned long long HASH_INIT = 14695981039346656037ULL;
+
+static unsigned long long hash_file(FILE *fp)
+{
+    /* Use pread so as not to disturb the stdio read position. */
+    std::vector<char> buffer(65536);
+    unsigned long long h = HASH_INIT;
+    off_t offset = 0;
+    while (true) {
+        ssize_t n = pread(fileno(fp), &buffer[0], buffer.size(), offset);
+        if (n <= 0) break;
+        h = hash_bytes(h, &buffer[0], n);
+        offset += n;
+    }
+    return h;
+}
+
+
+static InputStamp make_stamp(const FileInfo &file)
+{
+    InputStamp s;
+    s.present = (file.fp != NULL && S_ISREG(file.stat.st_mode));
+    s.size = s.present ? file.stat.st_size : 0;
+    s.mtime_sec = s.present ? file.stat.st_mtim.tv_sec : 0;
+    s.mtime_nsec = s.present ? file.stat.st_mtim.tv_nsec : 0;
+    s.hash = 0;
+    s.hashed = !s.present;
+    return s;
+}
+
+
+/* manifest_save() deletes the stale outputs named in the old manifest,
+ * so a name that could lead outside the output directory is ignored,
+ * like any other malformed line: no absolute names, and no "..". */
+static bool is_safe_relative_name(const char *name)
+{
+    if (name[0] == '\0' || name[0] == '/')
+        return false;
+    for (const char *p = name; *p != '\0'; ) {
+        const char *slash = strchr(p, '/');
+        const size_t length = (slash != NULL) ? (size_t)(slash - p) : strlen(p);
+        if (length == 2 && p[0] == '.' && p[1] == '.')
+            return false;
+        p += length;
+        if (*p == '/')
+            ++p;
+    }
+    return true;
+}
+
+
+void manifest_load(Manifest &m, const std::string &root, const RecursiveOptions &opts)
+{
+    m.root = root;
+    m.num_files = opts.macro_names.size();
+
+    /* Anything that changes the output for unchanged input must be
+     * part of the fingerprint. */
+    unsigned long long h = HASH_INIT;
+    for (size_t i=0; i < opts.macro_names.size(); ++i) {
+        h = hash_bytes(h, opts.macro_names[i].c_str(), opts.macro_names[i].length() + 1);
+    }
+    h = hash_bytes(h, opts.use_only_simple_ifs ? "s" : "c", 1);
+    char extra[64];
+    sprintf(extra, "%d %llu %d", (int)opts.binary_policy, opts.cost_budget,
+            (int)opts.merge_by_similarity);
+    h = hash_bytes(h, extra, strlen(extra));
+    char header[64];
+    sprintf(header, MANIFEST_VERSION " %016llx", h);
+    m.header = header;
+
+    const std::string path = root + "/" MANIFEST_NAME;
+    FILE *in = fopen(path.c_str(), "r");
+    if (in == NULL)
+        return;
+    std::string line;
+    if (!getline(in, line) || line != m.header) {
+        /* Different options, or a different version of difdef.
+         * Ignore the stale manifest; everything will be regenerated. */
+        fclose(in);
+        return;
+    }
+    while (getline(in, line)) {
+        const char *p = line.c_str();
+        std::vector<InputStamp> stamps(m.num_files);
+        bool ok = true;
+        for (int i=0; ok && i < m.num_files; ++i) {
+            InputStamp &s = stamps[i];
+            int consumed = 0;
+            if (p[0] == '-' && p[1] == ' ') {
+                s.present = false;
+                s.size = 0;
+                s.mtime_sec = s.mtime_nsec = 0;
+                s.hash = 0;
+                s.hashed = true;
+                consumed = 2;
+            } else {
+                long long size, sec, nsec;
+                unsigned long long hash;
+                /* Exactly one space follows, since the name may begin
+                 * with more. */
+                if (sscanf(p, "%lld:%lld.%lld:%llx%n", &size, &sec, &nsec, &hash, &consumed) < 4 ||
+                        consumed == 0 || p[consumed] != ' ') {
+                    ok = false;
+                    break;
+                }
+                consumed += 1;
+                s.present = true;
+                s.size = size;
+                s.mtime_sec = sec;
+                s.mtime_nsec = nsec;
+                s.hash = hash;
+                s.hashed = true;
+            }
+            p += consumed;
+        }
+        if (ok && is_safe_relative_name(p)) {
+            m.old_entries[p] = stamps;
+        }
+    }
+    fclose(in);
+}
+
+
+static std::string relative_name(const Manifest &m, const std::string &output_name)
+{
+    assert(output_name.compare(0, m.root.length(), m.root) == 0);
+    if (output_name.length() == m.root.length())
+        return "";
+    assert(output_name[m.root.length()] == '/');
+    return output_name.substr(m.root.length() + 1);
+}
+
+
+bool manifest_is_current(Manifest &m, const std::string &output_name,
+                         const std::vector<FileInfo> &files)
+{
+    const std::string rel = relative_name(m, output_name);
+    std::map<std::string, std::vector<InputStamp> >::const_iterator it = m.old_entries.find(rel);
+    if (it == m.old_entries.end())
+        return false;
+    const std::vector<InputStamp> &old_stamps = it->second;
+    assert((int)old_stamps.size() == m.num_files);
+
+    struct stat st;
+    if (stat(output_name.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        /* Somebody removed our output. */
+        return false;
+    }
+
+    std::vector<InputStamp> stamps(files.size());
+    for (size_t i=0; i < files.size(); ++i) {
+        const InputStamp &old = old_stamps[i];
+        InputStamp &s = stamps[i];
+        s = make_stamp(files[i]);
+        if (s.present != old.present || s.size != old.size)
+            return false;
+        if (!s.present)
+            continue;
+        if (s.mtime_sec == old.mtime_sec && s.mtime_nsec == old.mtime_nsec) {
+            s.hash = old.hash;
+            s.hashed = true;
+        } else {
+            /* Touched, but perhaps not modified. */
+            s.hash = hash_file(files[i].fp);
+            s.hashed = true;
+            if (s.hash != old.hash)
+                return false;
+        }
+    }
+    m.new_entries[rel] = stamps;
+    return true;
+}
+
+
+/* Take the stamps while the inputs are still open; they're recorded
+ * only once the output has been written successfully. */
+std::vector<InputStamp> manifest_stamps(const std::vector<FileInfo> &files)
+{
+    std::vector<InputStamp> stamps(files.size());
+    for (size_t i=0; i < files.size(); ++i) {
+        stamps[i] = make_stamp(files[i]);
+        if (!stamps[i].hashed) {
+            stamps[i].hash = hash_file(files[i].fp);
+            stamps[i].hashed = true;
+        }
+    }
+    return stamps;
+}
+
+
+void manifest_record(Manifest &m, const std::string &output_name,
+                     const std::vector<InputStamp> &stamps)
+{
+    const std::string rel = relative_name(m, output_name);
+    if (rel.find('\n') != std::string::npos) {
+        /* Can't be represented in the manifest; always regenerate it. */
+        return;
+    }
+    m.new_entries[rel] = stamps;
+}
+
+
+void manifest_record_directory(Manifest &m, const std::string &output_name)
+{
+    m.live_directories.insert(relative_name(m, output_name));
+}
+
+
+void manifest_save(Manifest &m)
+{
+    /* Remove any outputs that we generated last time, but whose inputs
+     * have since disappeared. Then remove any directories that were
+     * left empty as a result, unless they still exist in the input. */
+    std::map<std::string, std::vector<InputStamp> >::const_iterator it;
+    for (it = m.old_entries.begin(); it != m.old_entries.end(); ++it) {
+        const std::string &rel = it->first;
+        if (m.new_entries.find(rel) != m.new_entries.end())
+            continue;
+        unlink((m.root + "/" + rel).c_str());
+        std::string dir = rel;
+        for (size_t slash; (slash = dir.rfind('/')) != std::string::npos; ) {
+            dir.erase(slash);
+            if (m.live_directories.find(dir) != m.live_directories.end())
+                break;
+            if (rmdir((m.root + "/" + dir).c_str()) != 0)
+                break;
+        }
+    }
+
+    const std::string path = m.root + "/" MANIFEST_NAME;
+    const std::string temp_path = path + ".tmp";
+    FILE *out = fopen(temp_path.c_str(), "w");
+    if (out == NULL) {
+        do_error("Output file '%s': Cannot create file", temp_path.c_str());
+    }
+    fprintf(out, "%s\n", m.header.c_str());
+    for (it = m.new_entries.begin(); it != m.new_entries.end(); ++it) {
+        const std::vector<InputStamp> &stamps = it->second;
+        for (size_t i=0; i < stamps.size(); ++i) {
+            const InputStamp &s = stamps[i];
+            if (s.present) {
+                fprintf(out, "%lld:%lld.%09lld:%016llx ", (long long)s.size,
+                        (long long)s.mtime_sec, (long long)s.mtime_nsec, s.hash);
+            } else {
+                fprintf(out, "- ");
+            }
+        }
+        fprintf(out, "%s\n", it->first.c_str());
+    }
+    if (fclose(out) != 0 || rename(temp_path.c_str(), path.c_str()) != 0) {
+        do_error("Output file '%s': Cannot create file", path.c_str());
+    }
+}
@@ -23,7 +23,12 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
 #include <set>
 #include <string>
 #include <vector>
@@ -31,17 +36,163 @@
 #include "diffn.h"
 
 
+/* Returns true if every version of this file is present, and all versions
+ * are byte-for-byte identical. In that case the merged output is exactly
+ * the input, so we can skip the merge entirely. Versions that share an
+ * inode are identical without our having to read them.
+ * On return, each file's read position has been rewound to the start.
+ */
+static bool all_versions_identical(std::vector<FileInfo> &files,
+                                   bool *ends_with_newline)
+{
+    const size_t num_files = files.size();
+    const struct stat &st0 = files[0].stat;
+    bool same_inode = true;
+    for (size_t i=0; i < num_files; ++i) {
+        if (files[i].fp == NULL || !S_ISREG(files[i].stat.st_mode))
+            return false;
+        if (files[i].stat.st_size != st0.st_size)
+            return false;
+        if (files[i].stat.st_dev != st0.st_dev || files[i].stat.st_ino != st0.st_ino)
+            same_inode = false;
+    }
+
+    *ends_with_newline = true;
+    if (st0.st_size == 0)
+        return true;
+
+    if (same_inode) {
+        char last;
+        if (pread(fileno(files[0].fp), &last, 1, st0.st_size - 1) != 1)
+            return false;
+        *ends_with_newline = (last == '\n');
+        return true;
+    }
+
+    std::vector<char> buffer0(65536);
+    std::vector<char> buffer(65536);
+    bool identical = true;
+    char last = '\n';
+    while (identical) {
+        const size_t n = fread(&buffer0[0], 1, buffer0.size(), files[0].fp);
+        if (n == 0) break;
+        last = buffer0[n-1];
+        for (size_t i=1; identical && i < num_files; ++i) {
+            if (fread(&buffer[0], 1, n, files[i].fp) != n || memcmp(&buffer0[0], &buffer[0], n) != 0)
+                identical = false;
+        }
+    }
+    /* A read error looks like end-of-file to fread(), and would have
+     * cut the comparison short. */
+    for (size_t i=0; i < num_files; ++i) {
+        if (ferror(files[i].fp))
+            do_error("Input file '%s': Read error", files[i].name.c_str());
+        rewind(files[i].fp);
+    }
+    *ends_with_newline = (last == '\n');
+    return identical;
+}
+
+
+/* Like GNU diff, call a file binary if its first block contains a NUL.
+ * Uses pread, so as not to disturb the read position. */
+static bool any_version_binary(const std::vector<FileInfo> &files)
+{
+    std::vector<char> buffer(32768);
+    for (size_t i=0; i < files.size(); ++i) {
+        if (files[i].fp == NULL || !S_ISREG(files[i].stat.st_mode))
+            continue;
+        const ssize_t n = pread(fileno(files[i].fp), &buffer[0], buffer.size(), 0);
+        if (n > 0 && memchr(&buffer[0], '\0', n) != NULL)
+            return true;
+    }
+    return false;
+}
+
+
+/* Produce "output_name" as a copy of "in". If the input's last line is
+ * unterminated, add the newline that the ordinary output path would have
+ * printed. With "link_identical", try a hard link first; the caller
+ * should understand that the output then shares storage with the input.
+ */
+static void copy_identical_file(const FileInfo &in, bool append_newline,
+                                bool link_identical, const std::string &output_name)
+{
+    if (link_identical && !append_newline) {
+        if (link(in.name.c_str(), output_name.c_str()) == 0)
+            return;
+        /* Probably EXDEV; fall back on copying. */
+    }
+
+    int out_fd = open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0) {
+        do_error("Output file '%s': Cannot create file", output_name.c_str());
+    }
+
+    const int in_fd = fileno(in.fp);
+    off_t offset = 0;
+    const off_t size = in.stat.st_size;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    /* Let the kernel do the copying (or share extents, on filesystems
+     * that support reflinks). */
+    while (offset < size) {
+        loff_t off_in = offset;
+        ssize_t n = copy_file_range(in_fd, &off_in, out_fd, NULL, size - offset, 0);
+        if (n <= 0) break;
+        offset += n;
+    }
+#endif
+    std::vector<char> buffer(65536);
+    while (offset < size) {
+        ssize_t n = pread(in_fd, &buffer[0], buffer.size(), offset);
+        if (n <= 0) {
+            close(out_fd);
+            do_error("Input file '%s': Read error", in.name.c_str());
+        }
+        for (ssize_t written = 0; written < n; ) {
+            ssize_t w = write(out_fd, &buffer[written], n - written);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                close(out_fd);
+                do_error("Output file '%s': Write error", output_name.c_str());
+            }
+            written += w;
+        }
+        offset += n;
+    }
+    if (append_newline && write(out_fd, "\n", 1) != 1) {
+        close(out_fd);
+        do_error("Output file '%s': Write error", output_name.c_str());
+    }
+    /* On NFS, say, a failed write may only show up here. */
+    if (close(out_fd) != 0) {
+        do_error("Output file '%s': Write error", output_name.c_str());
+    }
+}
+
+
+static const off_t PARALLEL_MIN_BYTES = 1 << 20;
+
+/* Like FileCloser, for a directory. */
+class DirCloser {
+    DIR *dir;
+public:
+    explicit DirCloser(DIR *dir): dir(dir) { }
+    ~DirCloser() { closedir(dir); }
+};
+
 void do_print_ifdefs_recursively(std::vector<FileInfo> &files,
-                                 const std::vector<std::string> &macro_names,
-                                 bool use_only_simple_ifs,
+                                 const RecursiveOptions &opts,
                                  const std::string &output_name)
 {
     const size_t num_files = files.size();
+    Manifest *manifest = opts.manifest;
 
     /* If what's in "files" is all regular files, diff them.
      * Otherwise, try stepping through each directory in parallel. */
     FileInfo *sample_regular = NULL;
     FileInfo *sample_directory = NULL;
+    FilesCloser files_closer(files);
     for (size_t i=0; i < num_files; ++i) {
         if (files[i].fp == NULL) {
             files[i].fp = fopen(files[i].name.c_str(), "r");
@@ -64,39 +215,109 @@ void do_print_ifdefs_recursively(std::vector<FileInfo> &files,
     }
 
     if (sample_regular != NULL) {
+        std::vector<InputStamp> stamps;
+        if (manifest != NULL) {
+            if (manifest_is_current(*manifest, output_name, files)) {
+                /* Nothing has changed since the last run. */
+                return;
+            }
+            stamps = manifest_stamps(files);
+            /* The old output might be a hard link to one of our inputs;
+             * make sure we don't write through it. */
+            unlink(output_name.c_str());
+        }
+
+        const bool is_binary = (opts.binary_policy != BINARY_TEXT && any_version_binary(files));
+        bool ends_with_newline;
+        if (all_versions_identical(files, &ends_with_newline)) {
+            /* Binary files are copied verbatim; text files get the
+             * final newline that our ordinary output would have. */
+            TraceSpan span("copy", output_name);
+            copy_identical_file(files[0], !ends_with_newline && !is_binary,
+                                opts.link_identical, output_name);
+            if (manifest != NULL)
+                manifest_record(*manifest, output_name, stamps);
+            return;
+        }
+
+        if (is_binary) {
+            const char *name = (sample_regular->name.c_str());
+            if (opts.binary_policy == BINARY_ERROR) {
+                do_error("Binary input file '%s' differs between versions.\n"
+                         "Incomplete output may have been left in the output directory.", name);
+            }
+            fprintf(diagnostics(), "WARNING: binary input file '%s' differs between versions; "
+                            "skipped '%s'\n", name, output_name.c_str());
+            return;
+        }
+
         /* Let's diff these files! */
         Difdef difdef(num_files);
+        difdef.set_line_pool(opts.line_pool);
+        difdef.set_classifier(classify_line);
+        difdef.set_cost_budget(opts.cost_budget);
+        difdef.set_merge_by_similarity(opts.merge_by_similarity);
+        if (run_stats != NULL) {
+            difdef.set_stats(&run_stats->engine);
+        }
+        off_t total_size = 0;
         for (size_t i=0; i < num_files; ++i) {
-            if (files[i].fp == NULL) {
-                /* This file couldn't be opened, above. */
-                continue;
-            }
-            assert(!S_ISDIR(files[i].stat.st_mode));
-            if (S_ISREG(files[i].stat.st_mode)) {
-                difdef.replace_file(i, files[i].fp);
-            } else {
-                difdef.replace_file(i, NULL);
-            }
-            fclose(files[i].fp);
+            if (files[i].fp != NULL)
+                total_size += files[i].stat.st_size;
+        }
+        if (total_size >= PARALLEL_MIN_BYTES) {
+            /* Starting threads isn't worth it for the typical small file. */
+            difdef.set_num_threads(opts.num_threads);
+        }
+        TraceSpan read_span("read", output_name);
+        std::vector<FILE *> ins(num_files);
+        for (size_t i=0; i < num_files; ++i) {
+            /* A file that couldn't be opened, above, or isn't a regular
+             * file, is empty. */
+            if (files[i].fp != NULL && S_ISREG(files[i].stat.st_mode))
+                ins[i] = files[i].fp;
         }
+        difdef.replace_files(&ins[0]);
+        close_files(files);
+        read_span.end();
 
+        TraceSpan merge_span("merge", output_name);
         Difdef::Diff diff = difdef.merge();
+        merge_span.end();
+        warn_about_approximations(difdef, output_name.c_str());
 
         /* Try to open the output file. */
         FILE *out = fopen(output_name.c_str(), "w");
         if (out == NULL) {
             do_error("Output file '%s': Cannot create file", output_name.c_str());
         }
+        FileCloser out_closer(out);
 
         /* Print out the diff. */
+        TraceSpan verify_span("verify", output_name);
         verify_properly_nested_directives(diff, &files[0]);
-        do_print_using_ifdefs(diff, macro_names, use_only_simple_ifs, out);
-        fclose(out);
+        verify_span.end();
+        TraceSpan write_span("write", output_name);
+        do_print_using_ifdefs(diff, opts.macro_names, opts.use_only_simple_ifs, out);
+        out_closer.release();
+        if (ferror(out) | fclose(out)) {
+            do_error("Output file '%s': Write error", output_name.c_str());
+        }
+        if (manifest != NULL)
+            manifest_record(*manifest, output_name, stamps);
 
     } else {
         /* Recursively diff the contents of these directories. */
         if (mkdir(output_name.c_str(), 0777)) {
-            do_error("Output path '%s': Cannot create directory", output_name.c_str());
+            struct stat st;
+            const bool can_reuse = (manifest != NULL && errno == EEXIST &&
+                                    stat(output_name.c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+            if (!can_reuse) {
+                do_error("Output path '%s': Cannot create directory", output_name.c_str());
+            }
+        }
+        if (manifest != NULL) {
+            manifest_record_directory(*manifest, output_name);
         }
         std::set<std::string> processed_filenames;
         processed_filenames.insert(".");
@@ -105,8 +326,10 @@ void do_print_ifdefs_recursively(std::vector<FileInfo> &files,
             if (files[i].fp == NULL)
                 continue;
             fclose(files[i].fp);
+            files[i].fp = NULL;
             DIR *dir = opendir(files[i].name.c_str());
             assert(dir != NULL);
+            DirCloser dir_closer(dir);
             while (struct dirent *file = readdir(dir)) {
                 std::string relative_name = file->d_name;
                 if (processed_filenames.find(relative_name) != processed_filenames.end()) {
@@ -120,10 +343,8 @@ void do_print_ifdefs_recursively(std::vector<FileInfo> &files,
                     subfiles[j].name = files[j].name + "/" + relative_name;
                 }
                 std::string suboutput_name = output_name + "/" + relative_name;
-                do_print_ifdefs_recursively(subfiles, macro_names, use_only_simple_ifs,
-                                            suboutput_name);
+                do_print_ifdefs_recursively(subfiles, opts, suboutput_name);
             }
-            closedir(dir);
         }
     }
 }
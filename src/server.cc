@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* "difdef --server" reads jobs from its standard input and writes the
+ * results to its standard output, one at a time, so that a program that
+ * runs many small merges pays for starting difdef only once. A request is
+ *     <argc> <num_buffers>\n
+ * followed by argc arguments and then num_buffers input buffers, each as
+ *     <length>\n<length bytes>
+ * The arguments are those of a difdef command line, without the program
+ * name. If there are buffers, they are the input files, in order, and the
+ * arguments must not name any. The response is
+ *     <exit status> <output length> <diagnostics length>\n<output><diagnostics>
+ * where the output is what difdef would have written to stdout, and the
+ * diagnostics what it would have written to stderr. The server exits
+ * when its input ends.
+ *
+ * Successive jobs share one Difdef::LinePool, so that lines they have in
+ * common are interned and classified only once. Between jobs, if the
+ * pool has grown beyond SERVER_POOL_LINES, it is emptied.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "diffn.h"
+
+static const size_t SERVER_POOL_LINES = 1000000;
+
+/* Read "<length>\n<length bytes>". The length comes from the client, so
+ * don't allocate it up front: read the field a chunk at a time, so that
+ * a bogus length runs into the end of the input rather than into the
+ * memory limit. */
+static const size_t FIELD_CHUNK = 65536;
+
+static bool read_field(FILE *in, std::string &field)
+{
+    unsigned long length;
+    if (fscanf(in, "%lu", &length) != 1 || getc(in) != '\n') {
+        return false;
+    }
+    field.clear();
+    try {
+        while (length != 0) {
+            const size_t n = std::min<unsigned long>(length, FIELD_CHUNK);
+            const size_t old_size = field.size();
+            field.resize(old_size + n);
+            if (fread(&field[old_size], 1, n, in) != n)
+                return false;
+            length -= n;
+        }
+    } catch (const std::bad_alloc &) {
+        return false;
+    }
+    return true;
+}
+
+static bool read_request(FILE *in, std::vector<std::string> &args,
+                         std::vector<std::string> &buffers)
+{
+    int argc, num_buffers;
+    const int n = fscanf(in, "%d %d", &argc, &num_buffers);
+    if (n == EOF) {
+        return false;
+    }
+    if (n != 2 || getc(in) != '\n' || argc < 0 || num_buffers < 0) {
+        do_error("--server: malformed request header");
+    }
+    args.resize(argc);
+    buffers.resize(num_buffers);
+    for (int i=0; i < argc; ++i) {
+        if (!read_field(in, args[i]))
+            do_error("--server: malformed argument %d", i+1);
+    }
+    for (int i=0; i < num_buffers; ++i) {
+        if (!read_field(in, buffers[i]))
+            do_error("--server: malformed buffer %d", i+1);
+    }
+    return true;
+}
+
+/* Run one job, capturing its output and diagnostics; returns its exit
+ * status. */
+static int run_server_job(std::vector<std::string> &args,
+                          const std::vector<std::string> &buffers,
+                          Difdef::LinePool &pool, FILE *out, FILE *err)
+{
+    std::vector<char *> argv;
+    argv.push_back((char *)"difdef");
+    for (size_t i=0; i < args.size(); ++i) {
+        argv.push_back(&args[i][0]);
+    }
+    argv.push_back(NULL);
+
+    JobContext job;
+    job.err = err;
+    job.mode = "--server";
+    current_job = &job;
+    const size_t memory_limit = Difdef::memory_limit();
+    int status = EXIT_SUCCESS;
+    try {
+        Options opts;
+        opts.buffers = buffers.empty() ? NULL : &buffers;
+        parse_options(argv.size() - 1, &argv[0], opts);
+        opts.line_pool = &pool;
+        if (opts.max_memory != 0) {
+            Difdef::set_memory_limit(opts.max_memory);
+        }
+        run_job(opts, out);
+    } catch (const JobError &e) {
+        fprintf(err, "ERROR: %s\n", e.what());
+        status = EXIT_FAILURE;
+    } catch (const std::bad_alloc &) {
+        fprintf(err, "ERROR: Out of memory\n");
+        status = EXIT_FAILURE;
+    }
+    /* A job that fails partway may leave these set. */
+    run_stats = NULL;
+    if (tracer != NULL) {
+        trace_close(0, err);
+    }
+    Difdef::set_memory_limit(memory_limit);
+    current_job = NULL;
+    return status;
+}
+
+int serve(FILE *in, FILE *out)
+{
+    Difdef::LinePool pool(SERVER_POOL_LINES);
+    std::vector<std::string> args;
+    std::vector<std::string> buffers;
+    while (read_request(in, args, buffers)) {
+        char *output = NULL;
+        size_t output_length = 0;
+        char *errors = NULL;
+        size_t errors_length = 0;
+        FILE *job_out = open_memstream(&output, &output_length);
+        FILE *job_err = open_memstream(&errors, &errors_length);
+        if (job_out == NULL || job_err == NULL) {
+            do_error("--server: Out of memory");
+        }
+        const int status = run_server_job(args, buffers, pool, job_out, job_err);
+        fclose(job_out);
+        fclose(job_err);
+        fprintf(out, "%d %lu %lu\n", status,
+                (unsigned long)output_length, (unsigned long)errors_length);
+        fwrite(output, 1, output_length, out);
+        fwrite(errors, 1, errors_length, out);
+        fflush(out);
+        free(output);
+        free(errors);
+        pool.trim();
+    }
+    return 0;
+}
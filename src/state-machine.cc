@@ -20,12 +20,98 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+/* Return a pointer to the first character in [p, end) that might matter
+ * to CStateMachine::update(): a quote, slash, star, backslash or NUL.
+ * Most lines of C code contain none of these at all, so it pays to
+ * look at 16 or 32 bytes at a time where the CPU allows it.
+ */
+static inline bool is_special(char c)
+{
+    return c == '"' || c == '\'' || c == '/' || c == '*' || c == '\\' || c == '\0';
+}
+
+static const char *find_special_scalar(const char *p, const char *end)
+{
+    while (p != end && !is_special(*p)) ++p;
+    return p;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+
+static const char *find_special_sse2(const char *p, const char *end)
+{
+    const __m128i dquote = _mm_set1_epi8('"');
+    const __m128i squote = _mm_set1_epi8('\'');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i star = _mm_set1_epi8('*');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i zero = _mm_setzero_si128();
+    while (end - p >= 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)p);
+        const __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, dquote), _mm_cmpeq_epi8(v, squote)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, slash), _mm_cmpeq_epi8(v, star))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, backslash), _mm_cmpeq_epi8(v, zero)));
+        const int bits = _mm_movemask_epi8(hits);
+        if (bits != 0)
+            return p + __builtin_ctz(bits);
+        p += 16;
+    }
+    return find_special_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *find_special_avx2(const char *p, const char *end)
+{
+    const __m256i dquote = _mm256_set1_epi8('"');
+    const __m256i squote = _mm256_set1_epi8('\'');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i star = _mm256_set1_epi8('*');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i zero = _mm256_setzero_si256();
+    while (end - p >= 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        const __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, dquote), _mm256_cmpeq_epi8(v, squote)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, slash), _mm256_cmpeq_epi8(v, star))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, backslash), _mm256_cmpeq_epi8(v, zero)));
+        const unsigned bits = _mm256_movemask_epi8(hits);
+        if (bits != 0)
+            return p + __builtin_ctz(bits);
+        p += 32;
+    }
+    return find_special_sse2(p, end);
+}
+
+typedef const char *(*FindSpecialFunction)(const char *, const char *);
+
+static FindSpecialFunction choose_find_special()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_special_avx2;
+    return find_special_sse2;
+}
+
+static const FindSpecialFunction find_special = choose_find_special();
+#else
+static const char *find_special(const char *p, const char *end)
+{
+    return find_special_scalar(p, end);
+}
+#endif
+
+
 struct CStateMachine {
     bool in_backslash;
     bool in_comment;
     bool in_string;
     bool in_char;
 
+    /* The four bools, packed into a state number from 0 to 15. */
+    enum { BACKSLASH = 1, COMMENT = 2, STRING = 4, CHAR = 8, NUM_STATES = 16 };
+
     CStateMachine() {
         reset();
     }
@@ -36,6 +122,16 @@ struct CStateMachine {
     bool in_something() const {
         return in_backslash || in_comment || in_string || in_char;
     }
+    int state() const {
+        return (in_backslash ? BACKSLASH : 0) | (in_comment ? COMMENT : 0) |
+               (in_string ? STRING : 0) | (in_char ? CHAR : 0);
+    }
+    void set_state(int s) {
+        in_backslash = (s & BACKSLASH);
+        in_comment = (s & COMMENT);
+        in_string = (s & STRING);
+        in_char = (s & CHAR);
+    }
     void reset() {
         in_backslash = false;
         in_comment = false;
@@ -44,10 +140,15 @@ struct CStateMachine {
     }
     void update(const std::string &line_) {
         const char *line = line_.c_str();
+        const char *end = line + line_.size();
         in_backslash = false;
-        for (int i=0; line[i] != '\0'; ++i) {
-            if (line[i] == '\\' && line[i+1] == '\0') {
-                return backslash(line);
+        for (size_t i=0; true; ++i) {
+            /* Skip the characters that can't change our state. */
+            i = find_special(line + i, end) - line;
+            if (line[i] == '\0') {
+                return backslash(line, line + i);
+            } else if (line[i] == '\\' && line[i+1] == '\0') {
+                return backslash(line, line + i+1);
             } else if (in_string) {
                 if (line[i] == '\\') ++i;
                 else if (line[i] == '"') in_string = false;
@@ -64,7 +165,7 @@ struct CStateMachine {
                     ++i;
                     in_comment = true;
                 } else if (line[i] == '/' && line[i+1] == '/') {
-                    return backslash(line);
+                    return backslash(line, line + i + strlen(line + i));
                 } else if (line[i] == '"') {
                     in_string = true;
                 } else if (line[i] == '\'') {
@@ -72,10 +173,8 @@ struct CStateMachine {
                 }
             }
         }
-        return backslash(line);
     }
-    void backslash(const char *line) {
-        const char *end = strchr(line, '\0');
+    void backslash(const char *line, const char *end) {
         in_backslash = (end != line && end[-1] == '\\');
         if (!in_backslash) {
             /* Resync better when processing not-quite-C input, such as
@@ -88,3 +187,60 @@ struct CStateMachine {
         }
     }
 };
+
+
+/* Return the state after reading "line" in state "s". update() ignores
+ * the incoming in_backslash, and the two entry states that matter in
+ * practice --- outside of everything, or inside a comment --- have been
+ * precomputed once per unique line by classify_line().
+ */
+static int next_state(const Difdef::Diff::Line &line, int s)
+{
+    s &= ~CStateMachine::BACKSLASH;
+    if (s == 0)
+        return (line.flags >> LINE_CLEAN_EXIT_SHIFT) & 0xF;
+    if (s == CStateMachine::COMMENT)
+        return (line.flags >> LINE_COMMENT_EXIT_SHIFT) & 0xF;
+    CStateMachine sm;
+    sm.set_state(s);
+    sm.update(*line.text);
+    return sm.state();
+}
+
+
+/* The states of all N versions at once. Versions that are in the same
+ * state are kept together in one mask, and advance together; so each
+ * line costs at most one transition per distinct state, no matter how
+ * many versions contain it.
+ */
+struct CStateGroups {
+    Difdef::mask_t in_state[CStateMachine::NUM_STATES];
+
+    explicit CStateGroups(Difdef::mask_t all_versions) {
+        for (int s=0; s < CStateMachine::NUM_STATES; ++s)
+            in_state[s] = 0;
+        in_state[0] = all_versions;
+    }
+    /* Versions that are not inside a comment, string, etc. */
+    Difdef::mask_t clean() const { return in_state[0]; }
+    Difdef::mask_t in_comment() const {
+        Difdef::mask_t result = 0;
+        for (int s=0; s < CStateMachine::NUM_STATES; ++s) {
+            if (s & CStateMachine::COMMENT)
+                result |= in_state[s];
+        }
+        return result;
+    }
+    void update(const Difdef::Diff::Line &line) {
+        Difdef::mask_t next[CStateMachine::NUM_STATES];
+        for (int s=0; s < CStateMachine::NUM_STATES; ++s)
+            next[s] = in_state[s] & ~line.mask;
+        for (int s=0; s < CStateMachine::NUM_STATES; ++s) {
+            const Difdef::mask_t moving = in_state[s] & line.mask;
+            if (moving != 0)
+                next[next_state(line, s)] |= moving;
+        }
+        for (int s=0; s < CStateMachine::NUM_STATES; ++s)
+            in_state[s] = next[s];
+    }
+};
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <cstdio>
+
+#include <time.h>
+
+#include "diffn.h"
+
+__thread RunStats *run_stats = NULL;
+
+unsigned long long stats_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* The phases, in the order they happen. The engine's slide time is part
+ * of its merge time, so it's indented under it in the text output. These
+ * are all wall-clock times, so they add up. */
+struct Phase {
+    const char *name;
+    int indent;
+    unsigned long long ns;
+};
+
+static std::vector<Phase> phases_of(const RunStats &stats)
+{
+    const Difdef::Stats &e = stats.engine;
+    const Phase phases[] = {
+        { "read", 0, e.read_ns },
+        { "intern", 0, e.intern_ns },
+        { "merge", 0, e.merge_ns },
+        { "slide", 1, e.slide_ns },
+        { "verify", 0, stats.verify_ns },
+        { "post-process", 0, stats.postprocess_ns },
+        { "render", 0, stats.render_ns },
+    };
+    return std::vector<Phase>(phases, phases + sizeof phases / sizeof *phases);
+}
+
+/* The patience and classical times, on the other hand, are summed over
+ * the threads that merge the interstices in parallel, so under -j they
+ * can exceed the merge time; they're reported apart, as CPU time. */
+static std::vector<Phase> cpu_phases_of(const RunStats &stats)
+{
+    const Difdef::Stats &e = stats.engine;
+    const Phase phases[] = {
+        { "patience", 1, e.patience_ns },
+        { "classical", 1, e.classical_ns },
+    };
+    return std::vector<Phase>(phases, phases + sizeof phases / sizeof *phases);
+}
+
+/* Indexed by Difdef::MemoryCategory. */
+static const char *const memory_categories[Difdef::NUM_MEMORY_CATEGORIES] = {
+    "interner", "lines", "diffs", "lcs"
+};
+
+void print_stats(const RunStats &stats, bool as_json, FILE *out)
+{
+    const Difdef::Stats &e = stats.engine;
+    const std::vector<Phase> phases = phases_of(stats);
+    const std::vector<Phase> cpu_phases = cpu_phases_of(stats);
+    const Difdef::MemoryUsage memory = Difdef::memory_usage();
+    if (as_json) {
+        fprintf(out, "{\"seconds\": {");
+        for (size_t i=0; i < phases.size(); ++i) {
+            fprintf(out, "%s\"%s\": %.6f", (i ? ", " : ""), phases[i].name, phases[i].ns / 1e9);
+        }
+        fprintf(out, "}, \"cpu_seconds\": {");
+        for (size_t i=0; i < cpu_phases.size(); ++i) {
+            fprintf(out, "%s\"%s\": %.6f", (i ? ", " : ""), cpu_phases[i].name, cpu_phases[i].ns / 1e9);
+        }
+        fprintf(out, "}, \"unique_lines\": %lu, \"max_depth\": %d, "
+                     "\"classical_calls\": %lu, \"classical_sizes\": {",
+                e.unique_lines, e.max_depth, e.classical_calls);
+        bool first = true;
+        for (int k=0; k < Difdef::Stats::NUM_SIZE_BUCKETS; ++k) {
+            if (e.classical_sizes[k] == 0) continue;
+            fprintf(out, "%s\"%lu\": %lu", (first ? "" : ", "), 1UL << k, e.classical_sizes[k]);
+            first = false;
+        }
+        fprintf(out, "}, \"lines_emitted\": %lu, \"memory\": {", stats.lines_emitted);
+        for (int c=0; c < Difdef::NUM_MEMORY_CATEGORIES; ++c) {
+            fprintf(out, "\"%s\": {\"current\": %lu, \"peak\": %lu}, ", memory_categories[c],
+                    (unsigned long)memory.current[c], (unsigned long)memory.peak[c]);
+        }
+        fprintf(out, "\"total\": {\"current\": %lu, \"peak\": %lu}}}\n",
+                (unsigned long)memory.total_current, (unsigned long)memory.total_peak);
+    } else {
+        fprintf(out, "difdef statistics:\n");
+        for (size_t i=0; i < phases.size(); ++i) {
+            fprintf(out, "  %s%-*s %12.6f s\n", (phases[i].indent ? "  " : ""),
+                    (phases[i].indent ? 20 : 22), phases[i].name, phases[i].ns / 1e9);
+        }
+        fprintf(out, "  merge CPU time, summed over threads:\n");
+        for (size_t i=0; i < cpu_phases.size(); ++i) {
+            fprintf(out, "    %-20s %12.6f s\n", cpu_phases[i].name, cpu_phases[i].ns / 1e9);
+        }
+        fprintf(out, "  %-22s %12lu\n", "unique lines", e.unique_lines);
+        fprintf(out, "  %-22s %12d\n", "max recursion depth", e.max_depth);
+        fprintf(out, "  %-22s %12lu\n", "classical fallbacks", e.classical_calls);
+        for (int k=0; k < Difdef::Stats::NUM_SIZE_BUCKETS; ++k) {
+            if (e.classical_sizes[k] == 0) continue;
+            char range[32];
+            sprintf(range, "%lu-%lu lines", 1UL << k, (2UL << k) - 1);
+            fprintf(out, "    %-20s %12lu\n", range, e.classical_sizes[k]);
+        }
+        fprintf(out, "  %-22s %12lu\n", "lines emitted", stats.lines_emitted);
+        fprintf(out, "  %-22s %12s %12s\n", "memory (bytes)", "current", "peak");
+        for (int c=0; c < Difdef::NUM_MEMORY_CATEGORIES; ++c) {
+            fprintf(out, "    %-20s %12lu %12lu\n", memory_categories[c],
+                    (unsigned long)memory.current[c], (unsigned long)memory.peak[c]);
+        }
+        fprintf(out, "    %-20s %12lu %12lu\n", "total",
+                (unsigned long)memory.total_current, (unsigned long)memory.total_peak);
+    }
+}
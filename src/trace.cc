@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2012 Arthur O'Dwyer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* The --trace option writes one "complete" event per TraceSpan, in the
+ * Chrome trace-event format that chrome://tracing and Perfetto load:
+ *     {"name": "merge", "cat": "difdef", "ph": "X", "ts": 1234, "dur": 56,
+ *      "pid": 1, "tid": 1, "args": {"file": "out/foo.c"}}
+ * with times in microseconds since trace_open(). Events are written as
+ * they finish, so the file is useful even if a later file fails.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "diffn.h"
+
+struct Tracer {
+    FILE *out;
+    unsigned long long origin;
+    bool first_event;
+    pthread_mutex_t lock;
+    std::vector<pthread_t> threads;  /* tid N is threads[N-1] */
+    std::map<std::string, unsigned long long> file_ns;
+};
+
+Tracer *tracer = NULL;
+
+void trace_open(const char *filename)
+{
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+        do_error("Trace file '%s': Cannot create file", filename);
+    }
+    tracer = new Tracer;
+    tracer->out = out;
+    tracer->origin = stats_clock();
+    tracer->first_event = true;
+    pthread_mutex_init(&tracer->lock, NULL);
+    fprintf(out, "[\n");
+}
+
+static void print_json_string(const std::string &s, FILE *out)
+{
+    putc('"', out);
+    for (size_t i=0; i < s.length(); ++i) {
+        const unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            putc(c, out);
+        }
+    }
+    putc('"', out);
+}
+
+void trace_record(const char *phase, const std::string &file,
+                  unsigned long long start, unsigned long long end)
+{
+    pthread_mutex_lock(&tracer->lock);
+    const pthread_t self = pthread_self();
+    size_t tid = 0;
+    while (tid < tracer->threads.size() && !pthread_equal(tracer->threads[tid], self))
+        ++tid;
+    if (tid == tracer->threads.size())
+        tracer->threads.push_back(self);
+
+    FILE *out = tracer->out;
+    fprintf(out, "%s{\"name\": \"%s\", \"cat\": \"difdef\", \"ph\": \"X\", "
+                 "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, \"args\": {\"file\": ",
+            (tracer->first_event ? "" : ",\n"), phase,
+            (start - tracer->origin) / 1e3, (end - start) / 1e3, (int)tid + 1);
+    print_json_string(file, out);
+    fprintf(out, "}}");
+    tracer->first_event = false;
+    tracer->file_ns[file] += end - start;
+    pthread_mutex_unlock(&tracer->lock);
+}
+
+static bool slower(const std::pair<std::string, unsigned long long> &a,
+                   const std::pair<std::string, unsigned long long> &b)
+{
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+}
+
+void trace_close(size_t top_k, FILE *summary)
+{
+    fprintf(tracer->out, "\n]\n");
+    fclose(tracer->out);
+
+    std::vector<std::pair<std::string, unsigned long long> > files(
+        tracer->file_ns.begin(), tracer->file_ns.end());
+    top_k = std::min(top_k, files.size());
+    std::partial_sort(files.begin(), files.begin() + top_k, files.end(), slower);
+    if (top_k != 0) {
+        fprintf(summary, "Slowest %d file(s):\n", (int)top_k);
+        for (size_t i=0; i < top_k; ++i) {
+            fprintf(summary, "  %12.6f s  %s\n", files[i].second / 1e9, files[i].first.c_str());
+        }
+    }
+
+    pthread_mutex_destroy(&tracer->lock);
+    delete tracer;
+    tracer = NULL;
+}
@@ -28,97 +28,98 @@
 #include "diffn.h"
 
 
-void do_print_unified_diff(const Difdef::Diff &diff,
+void do_print_unified_diff(const Difdef::EditScript &script,
                            const FileInfo files[],
                            size_t lines_of_context,
                            FILE *out)
 {
+    const unsigned long long start = (run_stats != NULL) ? stats_clock() : 0;
+    unsigned long lines_emitted = 2;
+    /* localtime_r(), because --batch jobs may be printing at once. */
     char timestamp[64];
+    struct tm tm;
     strftime(timestamp, sizeof timestamp, "%Y-%m-%d %H:%M:%S.000000000 %z",
-             localtime(&files[0].stat.st_mtime));
+             localtime_r(&files[0].stat.st_mtime, &tm));
     fprintf(out, "--- %s\t%s\n", files[0].name.c_str(), timestamp);
     strftime(timestamp, sizeof timestamp, "%Y-%m-%d %H:%M:%S.000000000 %z",
-             localtime(&files[1].stat.st_mtime));
+             localtime_r(&files[1].stat.st_mtime, &tm));
     fprintf(out, "+++ %s\t%s\n", files[1].name.c_str(), timestamp);
 
-    size_t abx = 0, ax = 0, bx = 0;
-    size_t n = diff.lines.size();
-    
-repeat:
+    typedef Difdef::EditScript::Run Run;
+    const std::vector<Run> &runs = script.runs;
+    const size_t num_runs = runs.size();
+    const size_t n = script.lines.size();
 
-    /* Find the first differing line. */
-    while (abx < n) {
-        if (diff.lines[abx].in_file(0) != diff.lines[abx].in_file(1))
-            break;
-        ++ax;
-        ++bx;
-        ++abx;
-    }
-    
-    if (abx == n) return;
-    
-    assert(diff.lines[abx].in_file(0) != diff.lines[abx].in_file(1));
-    assert(ax <= abx && bx <= abx);
-    const size_t first_diff_in_ab = abx;
-    const size_t first_diff_in_a = ax;
-    const size_t first_diff_in_b = bx;
-    
-    /* Find the last differing line in this hunk. We can subsume
-     * non-differing ranges of up to 2*lines_of_context lines. */
-    size_t non_differing_range = 0;
-    while (abx < n) {
-        if (diff.lines[abx].in_file(0) == diff.lines[abx].in_file(1)) {
-            if (non_differing_range == 2*lines_of_context) {
-                break;
+    /* "ax" and "bx" count the lines of each file before run "r". */
+    size_t ax = 0, bx = 0;
+    for (size_t r = 0; r < num_runs; ) {
+        if (runs[r].op == '=') {
+            ax += runs[r].length;
+            bx += runs[r].length;
+            ++r;
+            continue;
+        }
+
+        /* A hunk starts here. It subsumes any run of up to
+         * 2*lines_of_context common lines between differing runs. */
+        const size_t first_run = r;
+        const size_t first_diff_in_a = ax;
+        const size_t first_diff_in_b = bx;
+        size_t end_run = r;
+        size_t last_diff_in_a = ax, last_diff_in_b = bx;
+        for (size_t ra = ax, rb = bx; end_run < num_runs; ++end_run) {
+            const Run &run = runs[end_run];
+            if (run.op == '=') {
+                if (run.length > 2*lines_of_context || end_run+1 == num_runs)
+                    break;
+                ra += run.length;
+                rb += run.length;
+            } else {
+                ra += (run.op == '-') ? run.length : 0;
+                rb += (run.op == '+') ? run.length : 0;
+                last_diff_in_a = ra;
+                last_diff_in_b = rb;
             }
-            non_differing_range += 1;
-        } else {
-            non_differing_range = 0;
         }
-        ax += diff.lines[abx].in_file(0);
-        bx += diff.lines[abx].in_file(1);
-        ++abx;
-    }
-    
-    assert(abx <= n);
-    assert(ax <= abx && bx <= abx);
-    
-    const size_t last_diff_in_ab = (abx - non_differing_range);
-    const size_t last_diff_in_a = (ax - non_differing_range);
-    const size_t last_diff_in_b = (bx - non_differing_range);
-    
-    const size_t leading_context = std::min(first_diff_in_ab, lines_of_context);
-    const size_t trailing_context = std::min(n - last_diff_in_ab, lines_of_context);
+        const size_t first_diff = runs[first_run].first;
+        const size_t last_diff = runs[end_run-1].first + runs[end_run-1].length;
+
+        const size_t leading_context = std::min(first_diff, lines_of_context);
+        const size_t trailing_context = std::min(n - last_diff, lines_of_context);
+
+        const size_t hunk_size_in_a =
+            leading_context + (last_diff_in_a - first_diff_in_a) + trailing_context;
+        const size_t hunk_size_in_b =
+            leading_context + (last_diff_in_b - first_diff_in_b) + trailing_context;
 
-    const size_t hunk_size_in_a =
-        leading_context + (last_diff_in_a - first_diff_in_a) + trailing_context;
-    const size_t hunk_size_in_b =
-        leading_context + (last_diff_in_b - first_diff_in_b) + trailing_context;
+        /* Print the line numbers of the hunk. */
+        fprintf(out, "@@ -%d", (int)(first_diff_in_a - leading_context) + (hunk_size_in_a != 0));
+        if (hunk_size_in_a != 1) fprintf(out, ",%d", (int)hunk_size_in_a);
+        fprintf(out, " +%d", (int)(first_diff_in_b - leading_context) + (hunk_size_in_b != 0));
+        if (hunk_size_in_b != 1) fprintf(out, ",%d", (int)hunk_size_in_b);
+        fprintf(out, " @@\n");
+        lines_emitted += 1 + leading_context + (last_diff - first_diff) + trailing_context;
 
-    /* Print the line numbers of the hunk. */
-    fprintf(out, "@@ -%d", (int)(first_diff_in_a - leading_context) + (hunk_size_in_a != 0));
-    if (hunk_size_in_a != 1) fprintf(out, ",%d", (int)hunk_size_in_a);
-    fprintf(out, " +%d", (int)(first_diff_in_b - leading_context) + (hunk_size_in_b != 0));
-    if (hunk_size_in_b != 1) fprintf(out, ",%d", (int)hunk_size_in_b);
-    fprintf(out, " @@\n");
-    
-    /* Now print all the lines in the hunk between "start" and "end". */
-    for (size_t j = first_diff_in_ab - leading_context;
-                j < last_diff_in_ab + trailing_context; ++j) {
-        if (diff.lines[j].in_file(0) && diff.lines[j].in_file(1)) {
-            putc(' ', out);
-        } else if (diff.lines[j].in_file(0)) {
-            putc('-', out);
-        } else {
-            assert(diff.lines[j].in_file(1));
-            putc('+', out);
+        /* Now print the hunk, run by run. */
+        for (size_t j = first_diff - leading_context; j < first_diff; ++j) {
+            fprintf(out, " %s\n", script.lines[j]->c_str());
+        }
+        for (r = first_run; r < end_run; ++r) {
+            const Run &run = runs[r];
+            const char prefix = (run.op == '=') ? ' ' : run.op;
+            for (size_t j = run.first; j < run.first + run.length; ++j) {
+                putc(prefix, out);
+                fprintf(out, "%s\n", script.lines[j]->c_str());
+            }
+            ax += (run.op != '+') ? run.length : 0;
+            bx += (run.op != '-') ? run.length : 0;
+        }
+        for (size_t j = last_diff; j < last_diff + trailing_context; ++j) {
+            fprintf(out, " %s\n", script.lines[j]->c_str());
         }
-        fprintf(out, "%s\n", diff.lines[j].text->c_str());
     }
-
-    /* Any lines we skipped over are either part of the current hunk, or
-     * present in both versions (i.e., skipped as part of non_differing_range).
-     * Therefore we don't need to "rewind" {abx, ax, bx} at all. */
-    goto repeat;
+    if (run_stats != NULL) {
+        run_stats->render_ns += stats_clock() - start;
+        run_stats->lines_emitted += lines_emitted;
+    }
 }
-
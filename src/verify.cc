@@ -52,39 +52,66 @@ bool matches_if_directive(const std::string &s)
 }
 
 
+unsigned short classify_line(const std::string &s)
+{
+    unsigned short flags = 0;
+    if (matches_if_directive(s)) flags |= LINE_IS_IF;
+    else if (matches_pp_directive(s, "elif")) flags |= LINE_IS_ELIF;
+    else if (matches_pp_directive(s, "else")) flags |= LINE_IS_ELSE;
+    else if (matches_pp_directive(s, "endif")) flags |= LINE_IS_ENDIF;
+    if (s.empty()) flags |= LINE_IS_BLANK;
+
+    CStateMachine sm;
+    sm.update(s);
+    if (sm.in_something()) flags |= LINE_OPENS_CONSTRUCT;
+    flags |= (sm.state() << LINE_CLEAN_EXIT_SHIFT);
+    sm.set_state(CStateMachine::COMMENT);
+    sm.update(s);
+    flags |= (sm.state() << LINE_COMMENT_EXIT_SHIFT);
+    return flags;
+}
+
+
+/* Line numbers are needed only for error messages, so we don't
+ * bother keeping track of them for all N files as we go. */
+static int line_number_in_file(const Difdef::Diff &diff, size_t i, int v)
+{
+    int lineno = 0;
+    for (size_t j=0; j <= i; ++j) {
+        if (diff.lines[j].in_file(v))
+            lineno += 1;
+    }
+    return lineno;
+}
+
+
 void verify_properly_nested_directives(const Difdef::Diff &diff, const FileInfo files[])
 {
-    std::vector<CStateMachine> state_machines(diff.dimension);
+    const unsigned long long start = (run_stats != NULL) ? stats_clock() : 0;
+    CStateGroups states(diff.all_files_mask());
     std::vector<std::stack<char> > nest(diff.dimension);
-    std::vector<int> lineno(diff.dimension);
 
     for (size_t i=0; i < diff.lines.size(); ++i) {
-        const std::string &text = *diff.lines[i].text;
-        for (int v=0; v < diff.dimension; ++v) {
-            if (!diff.lines[i].in_file(v))
-                continue;
-            lineno[v] += 1;
-        }
-        const bool is_if = matches_if_directive(text);
-        const bool is_elif = matches_pp_directive(text, "elif");
-        const bool is_else = matches_pp_directive(text, "else");
-        const bool is_endif = matches_pp_directive(text, "endif");
-        const bool is_anything = is_if || is_elif || is_else || is_endif;
+        const Difdef::Diff::Line &line = diff.lines[i];
+        const bool is_if = (line.flags & LINE_IS_IF);
+        const bool is_elif = (line.flags & LINE_IS_ELIF);
+        const bool is_else = (line.flags & LINE_IS_ELSE);
+        const bool is_endif = (line.flags & LINE_IS_ENDIF);
+        const bool is_anything = (line.flags & LINE_IS_DIRECTIVE);
 
         if (is_anything) {
+            const Difdef::mask_t clean = states.clean() & line.mask;
             for (int v=0; v < diff.dimension; ++v) {
-                if (!diff.lines[i].in_file(v))
-                    continue;
-                if (state_machines[v].in_something())
+                if (!(clean & ((Difdef::mask_t)1 << v)))
                     continue;
                 if ((is_elif || is_else || is_endif) && nest[v].empty()) {
                     do_error("file %s, line %d: %s with no preceding #if",
-                             files[v].name.c_str(), lineno[v],
+                             files[v].name.c_str(), line_number_in_file(diff, i, v),
                              (is_elif ? "#elif" : is_else ? "#else" : "#endif"));
                 }
                 if ((is_elif || is_else) && nest[v].top() == 'e') {
                     do_error("file %s, line %d: unexpected %s following an #else",
-                             files[v].name.c_str(), lineno[v],
+                             files[v].name.c_str(), line_number_in_file(diff, i, v),
                              (is_elif ? "#elif" : "#else"));
                 }
                 if (is_if) {
@@ -99,18 +126,17 @@ void verify_properly_nested_directives(const Difdef::Diff &diff, const FileInfo
             }
         }
 
-        for (int v=0; v < diff.dimension; ++v) {
-            if (!diff.lines[i].in_file(v))
-                continue;
-            state_machines[v].update(text);
-        }
+        states.update(line);
     }
+    const Difdef::mask_t in_comment = states.in_comment();
     for (int v=0; v < diff.dimension; ++v) {
         const char *filename = files[v].name.c_str();
         if (!nest[v].empty()) {
             do_error("at end of file %s: expected #endif", filename);
-        } else if (state_machines[v].in_comment) {
+        } else if (in_comment & ((Difdef::mask_t)1 << v)) {
             do_error("at end of file %s: unterminated comment", filename);
         }
     }
+    if (run_stats != NULL)
+        run_stats->verify_ns += stats_clock() - start;
 }
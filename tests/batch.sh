@@ -0,0 +1,50 @@
+printf 'one\ntwo\n' >a
+printf 'one\n2\n' >b
+./difdef -DA -DB a b >expected
+./difdef -u a b >expected-u
+
+# Failing jobs mustn't stop the others, and output keeps the jobs' order.
+cat >jobs <<'JOBS'
+# A comment, then a blank line.
+
+-DA -DB a b -o 'out 1'
+--bogus a
+-DA -DB a b
+-u a b
+a -
+JOBS
+if ./difdef --batch=jobs -j3 >actual 2>errors; then
+    echo "Succeeded despite failing jobs"
+fi
+diff expected 'out 1'
+cat expected expected-u | diff - actual
+cat >expected-errors <<'ERRORS'
+jobs:4: ERROR: invalid option '--bogus'
+jobs:7: ERROR: standard input is not available in a --batch job
+ERRORS
+diff expected-errors errors
+
+echo '-DA -DB a b -o out2' >jobs
+./difdef --batch=jobs
+diff expected out2
+
+# A job's output is written out as soon as it and the jobs before it are
+# done, while later jobs are still running.
+mkfifo later
+printf -- '-DA -DB a b\n-DA -DB a later\n' >jobs
+./difdef --batch=jobs -j1 >streamed &
+batch=$!
+for i in $(seq 1 50); do
+    [ -s streamed ] && break
+    sleep 0.1
+done
+diff expected streamed >/dev/null || echo "Held the first job's output until the second was done"
+printf 'one\n2\n' >later
+wait $batch
+cat expected expected | diff - streamed
+
+if ./difdef --batch=jobs a >/dev/null 2>&1; then
+    echo "Accepted --batch with input files"
+fi
+
+rm -f a b expected expected-u jobs actual errors expected-errors 'out 1' out2 later streamed
@@ -0,0 +1,77 @@
+make -s -C .. libdifdef.a
+cat >c-api.c <<'EOF'
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "difdef_c.h"
+
+int main(void)
+{
+    static const char a[] = "one\ntwo\nthree\n";
+    static const char b[] = "one\n2\nthree";
+    difdef_t *d = difdef_create(2);
+    size_t i;
+    if (difdef_create(0) != NULL || errno != EINVAL)
+        puts("Accepted zero files");
+    if (difdef_load_buffer(d, 2, a, strlen(a)) != -1 || errno != EINVAL)
+        puts("Accepted a bad file id");
+    if (difdef_load_buffer(d, 0, a, strlen(a)) != 0 || difdef_load_buffer(d, 1, b, strlen(b)) != 0)
+        puts("Failed to load the buffers");
+    if (difdef_merge(d, 4) != NULL || errno != EINVAL)
+        puts("Accepted a bad mask");
+    difdef_diff_t *diff = difdef_merge(d, 3);
+    for (i=0; i < difdef_diff_num_lines(diff); ++i) {
+        size_t length;
+        unsigned int mask;
+        const char *text = difdef_diff_line(diff, i, &length, &mask);
+        printf("%u %.*s\n", mask, (int)length, text);
+    }
+    if (difdef_diff_line(diff, i, NULL, NULL) != NULL)
+        puts("Returned a line past the end");
+    difdef_diff_destroy(diff);
+
+    difdef_load_buffer(d, 1, NULL, 0);
+    diff = difdef_merge(d, 3);
+    if (difdef_diff_num_lines(diff) != 3)
+        puts("Didn't load an empty buffer");
+    difdef_diff_destroy(diff);
+    difdef_destroy(d);
+
+    /* Merging a subset leaves the other files out entirely. */
+    d = difdef_create(3);
+    difdef_load_buffer(d, 0, "one\ntwo\n", 8);
+    difdef_load_buffer(d, 1, "one\nmiddle\ntwo\n", 15);
+    difdef_load_buffer(d, 2, "one\nthree\n", 10);
+    diff = difdef_merge(d, 5);
+    for (i=0; i < difdef_diff_num_lines(diff); ++i) {
+        size_t length;
+        unsigned int mask;
+        const char *text = difdef_diff_line(diff, i, &length, &mask);
+        printf("%u %.*s\n", mask, (int)length, text);
+    }
+    difdef_diff_destroy(diff);
+    difdef_destroy(d);
+
+    d = difdef_create(1);
+    difdef_load_buffer(d, 0, "x\n\ny\n", 5);
+    diff = difdef_merge(d, 1);
+    if (difdef_diff_num_lines(diff) != 3 || difdef_diff_line(diff, 1, &i, NULL) == NULL || i != 0)
+        puts("Split a buffer with an empty line wrongly");
+    difdef_diff_destroy(diff);
+    difdef_destroy(d);
+    return 0;
+}
+EOF
+cc -W -Wall -I../libsrc c-api.c ../libdifdef.a -lstdc++ -lm -pthread -o c-api
+./c-api >actual
+cat >expected <<EOF
+3 one
+1 two
+2 2
+3 three
+5 one
+1 two
+4 three
+EOF
+diff expected actual
+rm -f c-api.c c-api expected actual
@@ -0,0 +1,32 @@
+mkdir a b
+printf 'same\000blob' >a/same.bin
+cp a/same.bin b/same.bin
+printf 'one\000\nblob\n' >a/differs.bin
+printf 'two\000\nblob\n' >b/differs.bin
+echo "text" >a/text.txt
+echo "text" >b/text.txt
+
+./difdef -r -DA -DB a b -o out 2>warnings
+if ! cmp -s a/same.bin out/same.bin; then
+    echo "Failed to copy an identical binary file verbatim"
+fi
+if [ -e out/differs.bin ]; then
+    echo "Produced output for a differing binary file by default"
+fi
+if ! grep -q 'differs.bin' warnings; then
+    echo "Failed to warn about skipping a binary file"
+fi
+diff a/text.txt out/text.txt
+rm -rf out
+
+if ./difdef -r --binary=error -DA -DB a b -o out 2>/dev/null; then
+    echo "Failed to stop at a differing binary file with --binary=error"
+fi
+rm -rf out
+
+./difdef -r --binary=text -DA -DB a b -o out
+if [ ! -e out/differs.bin ]; then
+    echo "Failed to merge a binary file with --binary=text"
+fi
+
+rm -rf a b out warnings
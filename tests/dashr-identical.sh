@@ -0,0 +1,32 @@
+mkdir a b
+cat >a/same.txt <<EOF
+identical
+in both
+EOF
+cp a/same.txt b/same.txt
+printf 'no trailing newline' >a/unterminated.txt
+cp a/unterminated.txt b/unterminated.txt
+ln a/same.txt a/linked.txt
+ln a/same.txt b/linked.txt
+
+./difdef -r -DA -DB a b -o out
+mkdir expected
+cp a/same.txt expected/same.txt
+cp a/same.txt expected/linked.txt
+echo 'no trailing newline' >expected/unterminated.txt
+diff -r expected out
+if [ out/same.txt -ef a/same.txt ]; then
+    echo "Hard-linked an identical file without --link-identical"
+fi
+rm -rf out
+
+./difdef -r --link-identical -DA -DB a b -o out
+diff -r expected out
+if [ ! out/same.txt -ef a/same.txt ]; then
+    echo "Failed to hard-link an identical file with --link-identical"
+fi
+if [ out/unterminated.txt -ef a/unterminated.txt ]; then
+    echo "Hard-linked a file whose output must differ from its input"
+fi
+
+rm -rf a b expected out
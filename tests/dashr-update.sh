@@ -0,0 +1,65 @@
+mkdir a b
+echo "shared" >a/keep.txt
+cp a/keep.txt b/keep.txt
+echo "old a" >a/changed.txt
+echo "old b" >b/changed.txt
+mkdir a/gone
+echo "doomed" >a/gone/removed.txt
+
+./difdef -r --update -DA -DB a b -o out
+./difdef -r -DA -DB a b -o expected
+diff -r -x .difdef-manifest expected out
+if [ ! -f out/.difdef-manifest ]; then
+    echo "Failed to write a manifest with --update"
+fi
+rm -rf expected
+
+# Mark an output whose inputs won't change; it should be kept as-is.
+echo "kept" >>out/keep.txt
+echo "new b" >b/changed.txt
+rm -r a/gone
+./difdef -r --update -DA -DB a b -o out
+
+cat >expected <<EOF
+shared
+kept
+EOF
+diff expected out/keep.txt
+cat >expected <<EOF
+#ifdef A
+old a
+#endif /* A */
+#ifdef B
+new b
+#endif /* B */
+EOF
+diff expected out/changed.txt
+if [ -e out/gone ]; then
+    echo "Failed to remove an output whose inputs disappeared"
+fi
+
+# A name may begin with blanks.
+printf 'blank\n' >'a/ leading.txt'
+cp 'a/ leading.txt' 'b/ leading.txt'
+./difdef -r --update -DA -DB a b -o out
+echo "kept" >>'out/ leading.txt'
+./difdef -r --update -DA -DB a b -o out
+printf 'blank\nkept\n' | diff - 'out/ leading.txt'
+
+# A manifest naming paths outside the output directory mustn't make us
+# delete them.
+echo "precious" >victim
+echo "- - ../victim" >>out/.difdef-manifest
+echo "- - $PWD/victim" >>out/.difdef-manifest
+echo "- - gone/../../victim" >>out/.difdef-manifest
+./difdef -r --update -DA -DB a b -o out
+if [ ! -f victim ]; then
+    echo "Deleted a file outside the output directory"
+fi
+
+# Changing the options must regenerate everything.
+./difdef -r --update -DX -DY a b -o out
+echo "shared" >expected
+diff expected out/keep.txt
+
+rm -rf a b expected out victim
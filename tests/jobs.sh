@@ -0,0 +1,30 @@
+for i in 1 2 3; do
+    echo "anchor $i"
+    seq 1 1200 | sed 's/^/line /'
+done >a
+for i in 1 2 3; do
+    echo "anchor $i"
+    seq 1 1200 | sed -e 's/^/line /' -e '/0$/d' -e '/7$/s/$/ changed/'
+done >b
+
+./difdef a b >expected
+./difdef -j4 a b >actual
+diff expected actual
+./difdef --jobs=3 -DA -DB a b >actual
+./difdef -DA -DB a b >expected
+diff expected actual
+
+# With -j, the files are also read in parallel; repeated lines, tabs
+# and a missing final newline must come out the same.
+printf 'x\n\tline 1 \n\nx\n' >c
+printf 'x\nx' >d
+./difdef -t a b c d b >expected
+./difdef -t -j4 a b c d b >actual
+diff expected actual
+
+# Only the first of two "-"s gets standard input.
+seq 1 200000 | ./difdef - - >expected
+seq 1 200000 | ./difdef -j4 - - >actual
+diff expected actual
+
+rm -f a b c d expected actual
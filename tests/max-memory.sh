@@ -0,0 +1,27 @@
+seq 1 2000 | sed 's/^/line /' >a
+seq 1 2000 | sed -e 's/^/line /' -e '/5$/s/$/ changed/' >b
+
+# A generous limit doesn't change the output.
+./difdef -DA -DB a b >expected
+./difdef --max-memory=64M -DA -DB a b >actual
+diff expected actual
+
+# A stingy one fails cleanly, with a message rather than a crash.
+if ./difdef --max-memory=10K -DA -DB a b >actual 2>error; then
+    echo "Exceeded --max-memory=10K without failing"
+fi
+if ! grep -q '^ERROR: Out of memory: the merge needs more than --max-memory=10240 bytes$' error; then
+    echo "Wrong error message for exceeding --max-memory"
+fi
+if ./difdef --max-memory=lots a b >/dev/null 2>&1; then
+    echo "Accepted an invalid --max-memory"
+fi
+
+./difdef --stats a b >/dev/null 2>stats
+for category in interner lines diffs lcs total; do
+    if ! grep -q "^    $category  *[0-9]*  *[0-9]*$" stats; then
+        echo "Missing the memory used by $category"
+    fi
+done
+
+rm -f a b expected actual error stats
@@ -0,0 +1,14 @@
+seq 1 40 | sed 's/^/line /' >a
+seq 1 40 | sed -e 's/^/line /' -e '/7$/d' >b
+seq 1 40 | sed -e 's/^/line /' -e '/^line 1/s/$/ changed/' >c
+seq 1 40 | sed -e 's/^/line /' -e '/7$/d' -e '/3$/s/$/ changed/' >d
+
+# Merging in a different order may produce a different (but still
+# correct) merge; each file's lines must still come out in its own column.
+./difdef --merge-order=similarity a b c d >merged
+grep '^a' merged | cut -c5- | diff a -
+grep '^.b' merged | cut -c5- | diff b -
+grep '^..c' merged | cut -c5- | diff c -
+grep '^...d' merged | cut -c5- | diff d -
+
+rm -f a b c d merged
@@ -0,0 +1,60 @@
+printf 'one\ntwo\n' >a
+printf 'one\n2\n' >b
+./difdef -DA -DB a b >expected
+
+# The same merge from files and from buffers, then a failing job, all
+# in one process; the failure mustn't stop the next job.
+{
+    printf '4 0\n3\n-DA3\n-DB1\na1\nb'
+    printf '2 2\n3\n-DA3\n-DB8\none\ntwo\n6\none\n2\n'
+    printf '2 0\n7\n--bogus1\na'
+    printf '1 0\n1\na'
+} | ./difdef --server >actual
+{
+    echo "0 $(($(wc -c <expected))) 0"
+    cat expected
+    echo "0 $(($(wc -c <expected))) 0"
+    cat expected
+    echo "1 0 32"
+    echo "ERROR: invalid option '--bogus'"
+    echo "0 10 0"
+    printf 'aone\natwo\n'
+} >expected-responses
+diff expected-responses actual
+
+# A field longer than the rest of the request is a framing error, not
+# an attempt to allocate that much.
+printf '2 1\n2\n-u1\na99999999999\none\n' | ./difdef --server >actual 2>errors && echo "Accepted a truncated buffer"
+grep -q 'malformed buffer 1' errors || cat errors
+
+if ./difdef --server a </dev/null >/dev/null 2>&1; then
+    echo "Accepted --server with input files"
+fi
+
+# Failing jobs must not leak the files they had open.
+printf '#endif\n' >bad
+printf 'one\n' >good
+mkdir x y
+cp bad x/f
+cp good y/f
+field() { printf '%d\n%s' ${#1} "$1"; }
+mkfifo requests
+./difdef --server <requests >responses &
+server=$!
+exec 3>requests
+for i in 1 2 3 4 5; do
+    { printf '6 0\n'; for arg in -DA -DB -o out.txt bad good; do field $arg; done; } >&3
+    { printf '7 0\n'; for arg in -DA -DB -r -o outdir x y; do field $arg; done; } >&3
+done
+for i in $(seq 1 100); do
+    [ "$(grep -c '^1 0 ' responses)" = 10 ] && break
+    sleep 0.1
+done
+if [ "$(ls /proc/$server/fd | wc -l)" != 3 ]; then
+    echo "Failed jobs left files open in the server"
+    ls -l /proc/$server/fd
+fi
+exec 3>&-
+wait $server
+
+rm -rf a b bad good x y out.txt outdir requests responses expected expected-responses actual errors
@@ -0,0 +1,13 @@
+# No line is unique, and both sides are too long for the exact algorithm.
+awk 'BEGIN { x = 1; for (i = 0; i < 6000; ++i) { x = (x * 75) % 65537; print "s" (x % 5) ";" } }' >a
+awk 'BEGIN { x = 2; for (i = 0; i < 6000; ++i) { x = (x * 75) % 65537; print "s" (x % 5) ";" } }' >b
+
+./difdef --speed-large-files a b >merged 2>warnings
+if ! grep -q WARNING warnings; then
+    echo "Failed to report the use of an approximate diff"
+fi
+# The result may not be minimal, but it must still be a correct merge.
+grep '^a' merged | cut -c3- | diff a -
+grep '^.b' merged | cut -c3- | diff b -
+
+rm -f a b merged warnings
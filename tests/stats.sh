@@ -0,0 +1,27 @@
+seq 1 100 | sed 's/^/line /' >a
+seq 1 100 | sed -e 's/^/line /' -e '/5$/s/$/ changed/' >b
+
+# The report goes to stderr, and doesn't change the output.
+./difdef -DA -DB a b >expected
+./difdef --stats -DA -DB a b >actual 2>stats
+diff expected actual
+for phase in read intern merge patience classical slide verify post-process render; do
+    if ! grep -q "^ *$phase  *[0-9.]* s$" stats; then
+        echo "Missing the time for phase $phase"
+    fi
+done
+# The patience and classical times are CPU time, reported apart from
+# the wall-clock phases.
+if ! sed -n '/^  merge CPU time, summed over threads:$/,$p' stats | grep -q "^    classical  *[0-9.]* s$"; then
+    echo "The patience and classical times aren't labeled as CPU time"
+fi
+if ! grep -q "^  lines emitted  *$(wc -l <expected)$" stats; then
+    echo "Wrong count of lines emitted"
+fi
+
+./difdef --stats=json a b >/dev/null 2>stats
+if ! grep -q '^{"seconds": {"read": [0-9.]*,.*}, "cpu_seconds": {"patience": [0-9.]*, "classical": [0-9.]*}, "unique_lines": 110,.*}$' stats; then
+    echo "Bad JSON statistics"
+fi
+
+rm -f a b expected actual stats
@@ -0,0 +1,24 @@
+mkdir a b
+seq 1 20 >a/same.txt
+cp a/same.txt b/same.txt
+seq 1 20 >a/differs.txt
+seq 2 21 >b/differs.txt
+
+./difdef -r -DA -DB a b -o out --trace=trace.json 2>summary
+for phase in copy read merge verify write; do
+    if ! grep -q "^{\"name\": \"$phase\", \"cat\": \"difdef\", \"ph\": \"X\", .*\"args\": {\"file\": \"out/.*\"}}" trace.json; then
+        echo "Missing a trace event for phase $phase"
+    fi
+done
+if [ "$(head -1 trace.json)" != "[" ] || [ "$(tail -1 trace.json)" != "]" ]; then
+    echo "The trace is not a JSON array"
+fi
+if ! grep -q '^Slowest 2 file(s):$' summary || ! grep -q 'out/differs.txt$' summary; then
+    echo "Missing the slowest-files summary"
+fi
+
+if ./difdef --trace=trace.json a/same.txt b/same.txt >/dev/null 2>&1; then
+    echo "Accepted --trace outside of recursive ifdef mode"
+fi
+
+rm -rf a b out trace.json summary
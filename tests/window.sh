@@ -0,0 +1,28 @@
+seq 1 50 | sed 's/^/line /' >a
+seq 1 50 | sed -e 's/^/line /' -e 's/^line 2[0-9]$/changed/' -e 's/^line 42$/&\nadded/' >b
+
+# With windows wider than any differing region, the result is the same.
+./difdef a b >expected
+./difdef --window=15 a b >actual
+diff expected actual
+
+# Without any unique shared line, each window is committed whole.
+yes x | head -4 >a
+yes y | head -4 >b
+./difdef --window=3 a b >actual 2>warnings
+cat >expected <<EOF
+a x
+a x
+a x
+ by
+ by
+ by
+a x
+ by
+EOF
+diff expected actual
+if ! grep -q WARNING warnings; then
+    echo "Failed to warn about a window without an anchor"
+fi
+
+rm -f a b expected actual warnings